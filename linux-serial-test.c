@@ -1,5 +1,6 @@
 // SPDX-License-Identifier: MIT
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <termios.h>
 #include <unistd.h>
@@ -17,6 +18,37 @@
 #include <linux/serial.h>
 #include <errno.h>
 #include <sys/file.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <math.h>
+#include <signal.h>
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+/*
+ * USDT probes for bpftrace/perf, e.g.
+ *   bpftrace -e 'usdt:./linux-serial-test:linux_serial_test:read { @bytes = hist(arg0); }'
+ * With sys/sdt.h (systemtap-sdt-dev) they are a single nop each, without
+ * it they compile to nothing.
+ */
+#if !defined(HAVE_SYS_SDT_H) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define HAVE_SYS_SDT_H 1
+#endif
+#endif
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define PROBE2(name, a, b) DTRACE_PROBE2(linux_serial_test, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(linux_serial_test, name, a, b, c)
+#else
+#define PROBE2(name, a, b) do { (void)(a); (void)(b); } while (0)
+#define PROBE3(name, a, b, c) do { (void)(a); (void)(b); (void)(c); } while (0)
+#endif
 
 //#define SHOW_TIOCGICOUNT
 #define DUMP_STAT_INTERVAL_SECONDS 2
@@ -73,6 +105,18 @@ int _cl_ascii_range = 0;
 int _cl_write_after_read = 0;
 int _cl_rx_timeout = 0;
 int _cl_color_output = 0;
+int _cl_mark_errors = 0;
+int _cl_flow_latency = 0;
+int _cl_queue_sample = 0;
+int _cl_tx_adaptive = -1;
+int _cl_frame_len = 0;
+int _cl_port_tag = 0;
+int _cl_rx_jitter = 0;
+int _cl_emulate = 0;
+int _cl_rs485_bench = 0;
+int _cl_kernel_bench = 0;
+char *_cl_results = NULL;
+char *_cl_compare = NULL;
 
 // Module variables
 unsigned char _write_count_value = 0;
@@ -80,16 +124,81 @@ unsigned char _read_count_value = 0;
 int _fd = -1;
 unsigned char * _write_data;
 ssize_t _write_size;
+ssize_t _read_size;
+unsigned char *_tx_frame;
+unsigned char *_rx_frame;
 
 // keep our own counts for cases where the driver stats don't work
 long long int _write_count = 0;
 long long int _read_count = 0;
 long long int _error_count = 0;
+long long int _write_calls = 0;
+
+// framed packet mode (--frame) counts
+long long int _frames_ok = 0;
+long long int _frames_bad = 0;
+long long int _frames_lost = 0;
+long long int _frames_reordered = 0;
+long long int _payload_bytes = 0;
+long long int _write_eagain_count = 0;
+
+// line errors marked in-band by the tty layer (--mark-errors)
+long long int _break_count = 0;
+long long int _line_error_count = 0;
+struct serial_icounter_struct _icount_start;
+int _icount_start_valid = 0;
 
 // for stats use
 struct timespec start_time;
 
+/*
+ * Port tagged streams (--port-tag): every sending port sends 4 byte cells
+ *   0: id of the port, its position in the -p list
+ *   1: id ^ 0xff, so that corruption does not look like another port
+ *   2: cell sequence number, 16 bit little endian
+ * Each receiver checks the id against the port it is routed to (itself
+ * unless a map is given) and the sequence number for lost data. Cells of
+ * another port of the run are crosstalk, broken cells are data errors.
+ */
+#define MAX_TAGGED_PORTS 16
+#define TAG_CELL_LEN 4
+
+int _port_id = 0;
+int _port_count = 1;
+// --port-tag=map: the port each port receives from, loopback by default
+int _tag_route[MAX_TAGGED_PORTS] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+int _tag_route_len = 0;
+int _rx_tag_source = 0;
+long long int _crosstalk_count = 0;
+long long int _crosstalk[MAX_TAGGED_PORTS];
+
+// multi port runs: what each child reports back to the parent
+struct port_report {
+	int source;
+	long long int rx;
+	long long int tx;
+	long long int crosstalk[MAX_TAGGED_PORTS];
+};
+
+int _report_fd = -1;
+
+// TX queue size in bytes, a page (the UART circular buffer) unless a driver reports more
+int _tx_queue_size;
+
+// adaptive TX holds off writing until this time once the queue is at its target
+int _tx_hold = 0;
+struct timespec _tx_resume_time;
+
+// set to stop helper threads at the end of the test
+volatile int _helpers_stop = 0;
+
 static int diff_ms(const struct timespec *t1, const struct timespec *t2);
+static long long int diff_us(const struct timespec *t1, const struct timespec *t2);
+static void timespec_add_ns(struct timespec *t, long long int ns);
+static void close_emulator(void);
+static void parse_emulate_options(char *arg);
+static void parse_rs485_bench_options(char *arg);
+static long long int char_time_ns(void);
 
 static void exit_handler(void)
 {
@@ -107,6 +216,18 @@ static void exit_handler(void)
 		free(_write_data);
 		_write_data = NULL;
 	}
+
+	free(_cl_results);
+	_cl_results = NULL;
+	free(_cl_compare);
+	_cl_compare = NULL;
+
+	free(_tx_frame);
+	_tx_frame = NULL;
+	free(_rx_frame);
+	_rx_frame = NULL;
+
+	close_emulator();
 }
 
 static void dump_data(unsigned char * b, int count)
@@ -128,6 +249,121 @@ static void dump_data_ascii(unsigned char * b, int count)
 	}
 }
 
+/*
+ * Histograms use power of two buckets: bucket 0 holds zero, bucket n
+ * holds values in [2^(n-1), 2^n). Percentiles come from a linear split of
+ * each bucket in HIST_SUB_BUCKETS, within about 3% of the exact value.
+ */
+#define HIST_BUCKETS 40
+#define HIST_SUB_BUCKETS 32
+
+struct histogram {
+	const char *name;
+	const char *unit;
+	long long int count;
+	long long int sum;
+	long long int min;
+	long long int max;
+	long long int buckets[HIST_BUCKETS];
+	long long int sub_buckets[HIST_BUCKETS][HIST_SUB_BUCKETS];
+};
+
+static long long int hist_bucket_low(int b)
+{
+	return b ? 1LL << (b - 1) : 0;
+}
+
+static long long int hist_bucket_width(int b)
+{
+	return b ? 1LL << (b - 1) : 1;
+}
+
+// last value of sub bucket s of bucket b
+static long long int hist_sub_bucket_high(int b, int s)
+{
+	long long int width = hist_bucket_width(b);
+
+	return hist_bucket_low(b) + ((s + 1) * width + HIST_SUB_BUCKETS - 1) / HIST_SUB_BUCKETS - 1;
+}
+
+static void hist_add(struct histogram *h, long long int v)
+{
+	int b;
+
+	if (v < 0)
+		v = 0;
+	b = v ? 64 - __builtin_clzll(v) : 0;
+	if (b >= HIST_BUCKETS)
+		b = HIST_BUCKETS - 1;
+
+	if (h->count == 0 || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	h->count++;
+	h->sum += v;
+	h->buckets[b]++;
+	if (v - hist_bucket_low(b) < hist_bucket_width(b))
+		h->sub_buckets[b][(v - hist_bucket_low(b)) * HIST_SUB_BUCKETS / hist_bucket_width(b)]++;
+	else
+		h->sub_buckets[b][HIST_SUB_BUCKETS - 1]++;
+}
+
+// upper bound of the sub bucket holding the pct percentile, clamped to max
+static long long int hist_percentile(const struct histogram *h, int pct)
+{
+	long long int seen = 0, want;
+	int b, s;
+
+	if (h->count == 0)
+		return 0;
+
+	want = (h->count * pct + 99) / 100;
+	for (b = 0; b < HIST_BUCKETS - 1; b++) {
+		if (seen + h->buckets[b] >= want)
+			break;
+		seen += h->buckets[b];
+	}
+	if (b == HIST_BUCKETS - 1)
+		return h->max;
+
+	for (s = 0; s < HIST_SUB_BUCKETS - 1; s++) {
+		seen += h->sub_buckets[b][s];
+		if (seen >= want)
+			break;
+	}
+	return hist_sub_bucket_high(b, s) < h->max ? hist_sub_bucket_high(b, s) : h->max;
+}
+
+static void hist_dump(const struct histogram *h)
+{
+	int b;
+
+	printf("%s: %s (%s): n=%lld", _cl_port, h->name, h->unit, h->count);
+	if (h->count == 0) {
+		printf("\n");
+		return;
+	}
+	printf(", min=%lld, avg=%lld, max=%lld, p50=%lld, p99=%lld\n",
+		h->min, h->sum / h->count, h->max,
+		hist_percentile(h, 50), hist_percentile(h, 99));
+
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		if (h->buckets[b] == 0)
+			continue;
+		printf("  %12lld - %-12lld %lld\n", hist_bucket_low(b),
+			b ? hist_bucket_low(b + 1) - 1 : 0, h->buckets[b]);
+	}
+}
+
+// read buffer with --rx-jitter, so that reads are not limited by -w
+#define RX_JITTER_READ_SIZE (64 * 1024)
+
+struct histogram _write_size_hist = { .name = "bytes per write", .unit = "bytes" };
+struct histogram _read_gap_hist = { .name = "gap between reads", .unit = "us" };
+struct histogram _read_size_hist = { .name = "bytes per read", .unit = "bytes" };
+struct timespec _last_rx_time;
+
 static void set_baud_divisor(int speed, int custom_divisor)
 {
 	// default baud was not found, so try to set a custom divisor
@@ -274,7 +510,8 @@ static void display_help(void)
 			"\n"
 			"  -h, --help\n"
 			"  -b, --baud         Baud rate, 115200, etc (115200 is default)\n"
-			"  -p, --port         Port (/dev/ttyS0, etc) (must be specified)\n"
+			"  -p, --port         Port (/dev/ttyS0, etc) (must be specified), a comma separated list\n"
+			"                     tests all of them at the same time\n"
 			"  -d, --divisor      UART Baud rate divisor (can be used to set custom baud rates)\n"
 			"  -R, --rx_dump      Dump Rx data (ascii, raw)\n"
 			"  -T, --detailed_tx  Detailed Tx data\n"
@@ -305,15 +542,65 @@ static void display_help(void)
 			"  -A, --ascii        Output bytes range from 32 to 126 (default is 0 to 255)\n"
 			"  -x, --rx-timeout   Read timeout (ms) before write\n"
 			"  -C, --color        Color output\n"
+			"  -M, --mark-errors  Mark parity/framing errors and breaks in-band (PARMRK) and count\n"
+			"                     them separately instead of as pattern errors\n"
+			"  -F, --flow-latency Sample RTS every given us, wait for CTS changes, and report the\n"
+			"                     bytes that still arrived (RTS) or left (CTS) after each\n"
+			"                     deassert and how long it took to stop (needs TIOCGICOUNT)\n"
+			"  -u, --queue-sample Sample the TX/RX kernel queue depth every given us and report\n"
+			"                     occupancy histograms and the time the queues were full or empty\n"
+			"  -W, --tx-adaptive  Size each write from the free TX queue space (TIOCOUTQ) and hold\n"
+			"                     the queue at the given depth in bytes (0 is the whole queue)\n"
+			"  -f, --frame        Send and check framed packets of the given length instead of the\n"
+			"                     counting pattern: sync word, sequence number, payload and CRC32\n"
+			"  -g, --port-tag     Tag each port's stream with its position in the -p list and count\n"
+			"                     bytes from other ports as crosstalk. Ports receive their own\n"
+			"                     stream unless routed by --port-tag=a/b/.. (port i receives\n"
+			"                     from the i-th entry)\n"
+			"  -j, --rx-jitter    Report histograms of the time between reads that returned data\n"
+			"                     and of the bytes each of them returned\n"
+			"  -E, --emulate      Test against an emulated UART on a pty instead of --port. Takes a\n"
+			"                     comma separated list of fifo=bytes (16), drop=, flip= and break=\n"
+			"                     probabilities per byte (0) and seed= (1). With --rs485-bench it\n"
+			"                     acts as a half duplex echo peer: settle=, tail= and turnaround=\n"
+			"                     set its driver enable, last byte and reply timing in ms (1, 1, 3)\n"
+			"  -Z, --rs485-bench  Sweep RS485 delay_rts_after_send/delay_rts_before_send in a\n"
+			"                     request/response test against an echo peer (-K on the far end)\n"
+			"                     and report the fastest safe setting. Takes delays=max (3),\n"
+			"                     sizes=a/b/.. (1/16/64), count= per setting (20), timeout=ms (100)\n"
+			"  -O, --results      Append a JSON record of the run (configuration, throughput, CPU,\n"
+			"                     errors, latency percentiles) to the given file\n"
+			"  -V, --compare      Compare with the runs of the same configuration in the given\n"
+			"                     results file and exit with 126 on a significant regression\n"
+			"  -X, --kernel-bench Time the generic and the specialized RX/TX pattern kernels\n"
+			"                     in memory and exit\n"
 			"\n"
 	      );
 }
 
+// --port-tag=a/b/..: port i receives the stream of port a, b, ..
+static void parse_tag_route(char *arg)
+{
+	char *save, *tok;
+
+	_tag_route_len = 0;
+	for (tok = strtok_r(arg, "/", &save); tok; tok = strtok_r(NULL, "/", &save)) {
+		char *endptr;
+		long v = strtol(tok, &endptr, 0);
+
+		if (*endptr || v < 0 || v >= MAX_TAGGED_PORTS || _tag_route_len == MAX_TAGGED_PORTS) {
+			fprintf(stderr, "ERROR: bad --port-tag route '%s'\n", tok);
+			exit(-EINVAL);
+		}
+		_tag_route[_tag_route_len++] = v;
+	}
+}
+
 static void process_options(int argc, char * argv[])
 {
 	for (;;) {
 		int option_index = 0;
-		static const char *short_options = "hb:p:d:R:TsSy:z:cBertq:Ql:a:w:o:i:P:kKAx:C";
+		static const char *short_options = "hb:p:d:R:TsSy:z:cBertq:Ql:a:w:o:i:P:kKAx:CMF:u:W:f:g::jE:Z:O:V:X";
 		static const struct option long_options[] = {
 			{"help", no_argument, 0, 0},
 			{"baud", required_argument, 0, 'b'},
@@ -343,6 +630,18 @@ static void process_options(int argc, char * argv[])
 			{"ascii", no_argument, 0, 'A'},
 			{"rx-timeout", required_argument, 0, 'x'},
 			{"color", required_argument, 0, 'C'},
+			{"mark-errors", no_argument, 0, 'M'},
+			{"flow-latency", required_argument, 0, 'F'},
+			{"queue-sample", required_argument, 0, 'u'},
+			{"tx-adaptive", required_argument, 0, 'W'},
+			{"frame", required_argument, 0, 'f'},
+			{"port-tag", optional_argument, 0, 'g'},
+			{"rx-jitter", no_argument, 0, 'j'},
+			{"emulate", required_argument, 0, 'E'},
+			{"rs485-bench", required_argument, 0, 'Z'},
+			{"results", required_argument, 0, 'O'},
+			{"compare", required_argument, 0, 'V'},
+			{"kernel-bench", no_argument, 0, 'X'},
 			{0,0,0,0},
 		};
 
@@ -462,6 +761,54 @@ static void process_options(int argc, char * argv[])
 		case 'C':
 			_cl_color_output = 1;
 			break;
+		case 'M':
+			_cl_mark_errors = 1;
+			break;
+		case 'F': {
+			char *endptr;
+			_cl_flow_latency = strtol(optarg, &endptr, 0);
+			break;
+		}
+		case 'u': {
+			char *endptr;
+			_cl_queue_sample = strtol(optarg, &endptr, 0);
+			break;
+		}
+		case 'W': {
+			char *endptr;
+			_cl_tx_adaptive = strtol(optarg, &endptr, 0);
+			break;
+		}
+		case 'f': {
+			char *endptr;
+			_cl_frame_len = strtol(optarg, &endptr, 0);
+			break;
+		}
+		case 'g':
+			_cl_port_tag = 1;
+			if (optarg)
+				parse_tag_route(optarg);
+			break;
+		case 'j':
+			_cl_rx_jitter = 1;
+			break;
+		case 'E':
+			_cl_emulate = 1;
+			parse_emulate_options(optarg);
+			break;
+		case 'Z':
+			_cl_rs485_bench = 1;
+			parse_rs485_bench_options(optarg);
+			break;
+		case 'O':
+			_cl_results = strdup(optarg);
+			break;
+		case 'V':
+			_cl_compare = strdup(optarg);
+			break;
+		case 'X':
+			_cl_kernel_bench = 1;
+			break;
 		}
 	}
 }
@@ -477,7 +824,7 @@ static void dump_serial_port_stats(void)
 
 	clock_gettime(CLOCK_MONOTONIC, &current);
 	ms_since_beginning = diff_ms(&current, &start_time);
-	printf("%s%s%s: t=%ds, rx=%lld (%lld bits/s), tx=%lld (%lld bits/s), rx err=%s%lld%s\n",
+	printf("%s%s%s: t=%ds, rx=%lld (%lld bits/s), tx=%lld (%lld bits/s), rx err=%s%lld%s",
 		_cl_color_output ? INFO_COLOR : NULL_COLOR,
 		_cl_rx_dump ? "\n" : "",
 		_cl_port, ms_since_beginning / 1000,
@@ -487,6 +834,59 @@ static void dump_serial_port_stats(void)
 		_error_count,
 		_cl_color_output ? RESET_COLOR : NULL_COLOR);
 
+	if (_cl_mark_errors) {
+		printf(", brk=%s%lld%s, par/frm=%s%lld%s",
+			_cl_color_output && _break_count > 0 ? ERROR_COLOR : NULL_COLOR,
+			_break_count,
+			_cl_color_output ? RESET_COLOR : NULL_COLOR,
+			_cl_color_output && _line_error_count > 0 ? ERROR_COLOR : NULL_COLOR,
+			_line_error_count,
+			_cl_color_output ? RESET_COLOR : NULL_COLOR);
+
+		/*
+		 * In-band marking cannot tell a parity error from a framing
+		 * error, so split them using the driver counters when present.
+		 */
+		if (_icount_start_valid && ioctl(_fd, TIOCGICOUNT, &icount) == 0) {
+			printf(" (frame=%d, parity=%d, overrun=%d, buf_overrun=%d)",
+				icount.frame - _icount_start.frame,
+				icount.parity - _icount_start.parity,
+				icount.overrun - _icount_start.overrun,
+				icount.buf_overrun - _icount_start.buf_overrun);
+		}
+	}
+
+	if (_cl_frame_len) {
+		long long int frames = _frames_ok + _frames_bad + _frames_lost;
+
+		printf(", frames ok=%lld, bad=%s%lld%s, lost=%s%lld%s, reordered=%lld, PER=%.2e, goodput=%lld bits/s",
+			_frames_ok,
+			_cl_color_output && _frames_bad > 0 ? ERROR_COLOR : NULL_COLOR,
+			_frames_bad,
+			_cl_color_output ? RESET_COLOR : NULL_COLOR,
+			_cl_color_output && _frames_lost > 0 ? ERROR_COLOR : NULL_COLOR,
+			_frames_lost,
+			_cl_color_output ? RESET_COLOR : NULL_COLOR,
+			_frames_reordered,
+			frames ? (double)(_frames_bad + _frames_lost) / frames : 0.0,
+			_payload_bytes * 8 * 1000 / ms_since_beginning);
+	}
+
+	if (_cl_port_tag) {
+		printf(", from port %d, crosstalk=%s%lld%s",
+			_rx_tag_source,
+			_cl_color_output && _crosstalk_count > 0 ? ERROR_COLOR : NULL_COLOR,
+			_crosstalk_count,
+			_cl_color_output ? RESET_COLOR : NULL_COLOR);
+	}
+
+	if (_cl_tx_adaptive >= 0) {
+		printf(", writes=%lld (%lld bytes avg), EAGAIN=%lld",
+			_write_calls, _write_calls ? _write_count / _write_calls : 0,
+			_write_eagain_count);
+	}
+	printf("\n");
+
 #if SHOW_TIOCGICOUNT
 	/* skip ioctl if TIOCGICOUNT was failed previously */
 	if (tiocgicount_failed)
@@ -512,237 +912,2234 @@ static unsigned char next_count_value(unsigned char c)
 	return c;
 }
 
-static int process_read_data(void)
+// the pattern value n bytes before c
+static unsigned char prev_count_value(unsigned char c, long long int n)
 {
-	unsigned char rb[_write_size * 2];
-	int c = read(_fd, &rb, sizeof(rb));
-	if (c > 0) {
-		if (_cl_rx_dump) {
-			if (_cl_rx_dump_ascii)
-				dump_data_ascii(rb, c);
-			else
-				dump_data(rb, c);
-		}
+	if (_cl_ascii_range && c >= 32 && c < 127)
+		return 32 + ((c - 32 - n) % 95 + 95) % 95;
+	return c - n;
+}
 
-		// verify read count is incrementing
-		int i;
-		for (i = 0; i < c; i++) {
-			if (_read_count == 0 && i==0) {
-					_read_count_value = rb[i];
-			} else if (rb[i] != _read_count_value) {
-				if (_cl_dump_err) {
-					printf("%sError, count: %lld, expected %02x, got %02x%s\n",
-							_cl_color_output ? ERROR_COLOR : NULL_COLOR,
-							_read_count + i, _read_count_value, rb[i],
-							_cl_color_output ? RESET_COLOR : NULL_COLOR);
-				}
-				_error_count++;
-				if (_cl_stop_on_error) {
-					dump_serial_port_stats();
-					exit(-EIO);
-				}
-				_read_count_value = rb[i];
-			}
-			_read_count_value = next_count_value(_read_count_value);
+// error classes, as passed to the error probe
+enum {
+	RX_ERR_PATTERN,
+	RX_ERR_BREAK,
+	RX_ERR_PARITY_FRAMING,
+	RX_ERR_CROSSTALK,
+	RX_ERR_FRAME_CRC,
+	RX_ERR_FRAME_LOST,
+};
+
+// stream position of the first error in the current read, -1 if none
+long long int _rx_first_error = -1;
+
+static void rx_error(int kind, long long int pos)
+{
+	PROBE2(error, kind, pos);
+	if (_rx_first_error < 0)
+		_rx_first_error = pos;
+
+	if (_cl_stop_on_error) {
+		dump_serial_port_stats();
+		exit(-EIO);
+	}
+}
+
+// check a received data byte at stream position pos against the pattern
+static inline void check_read_value(unsigned char b, long long int pos)
+{
+	if (pos == 0) {
+		_read_count_value = b;
+	} else if (b != _read_count_value) {
+		if (_cl_dump_err) {
+			printf("%sError, count: %lld, expected %02x, got %02x%s\n",
+					_cl_color_output ? ERROR_COLOR : NULL_COLOR,
+					pos, _read_count_value, b,
+					_cl_color_output ? RESET_COLOR : NULL_COLOR);
 		}
-		_read_count += c;
+		_error_count++;
+		rx_error(RX_ERR_PATTERN, pos);
+		PROBE2(resync, pos, b);
+		_read_count_value = b;
 	}
-	return c;
+	_read_count_value = next_count_value(_read_count_value);
 }
 
-static int process_write_data(void)
+// fill buf with the tagged stream of this port starting at stream position pos
+static void fill_tag_data(unsigned char *buf, long long int pos, ssize_t len)
 {
-	ssize_t count = 0;
-	ssize_t actual_write_size = 0;
-	int repeat = (_cl_tx_bytes == 0);
+	ssize_t i;
 
-	do
-	{
-		if (_cl_write_after_read == 0) {
-			actual_write_size = _write_size;
-		} else {
-			actual_write_size = _read_count > _write_count ? _read_count - _write_count : 0;
-			if (actual_write_size > _write_size) {
-				actual_write_size = _write_size;
-			}
-		}
-		if (actual_write_size == 0) {
+	for (i = 0; i < len; i++, pos++) {
+		unsigned int seq = pos / TAG_CELL_LEN;
+
+		switch (pos % TAG_CELL_LEN) {
+		case 0:
+			buf[i] = _port_id;
+			break;
+		case 1:
+			buf[i] = _port_id ^ 0xff;
+			break;
+		case 2:
+			buf[i] = seq;
+			break;
+		default:
+			buf[i] = seq >> 8;
 			break;
 		}
+	}
+}
 
-		ssize_t i;
-		for (i = 0; i < actual_write_size; i++) {
-			_write_data[i] = _write_count_value;
-			_write_count_value = next_count_value(_write_count_value);
-		}
+unsigned char _rx_tag_cell[TAG_CELL_LEN];
+int _rx_tag_fill = 0;
+int _rx_tag_synced = 0;
+int _rx_tag_resync = 0;
+uint16_t _rx_tag_next_seq;
 
-		ssize_t c = write(_fd, _write_data, actual_write_size);
+static void tag_rx_byte(unsigned char b, long long int pos)
+{
+	unsigned char *cell = _rx_tag_cell;
+	uint16_t seq;
+	int id;
+
+	cell[_rx_tag_fill++] = b;
+	if (_rx_tag_fill < TAG_CELL_LEN)
+		return;
 
-		if (c < 0) {
-			if (errno != EAGAIN) {
-				printf("write failed - errno=%d (%s)\n", errno, strerror(errno));
+	id = cell[0];
+	if (cell[1] != (id ^ 0xff) || id >= _port_count) {
+		// not a cell header, count one error and slide until one shows up
+		if (!_rx_tag_resync) {
+			if (_cl_dump_err) {
+				printf("%sError, count: %lld, bad tag %02x %02x%s\n",
+						_cl_color_output ? ERROR_COLOR : NULL_COLOR,
+						pos, cell[0], cell[1],
+						_cl_color_output ? RESET_COLOR : NULL_COLOR);
 			}
-			c = 0;
-		} else {
-			repeat = 0;
+			_error_count++;
+			rx_error(RX_ERR_PATTERN, pos);
+			_rx_tag_resync = 1;
 		}
+		memmove(cell, cell + 1, TAG_CELL_LEN - 1);
+		_rx_tag_fill = TAG_CELL_LEN - 1;
+		return;
+	}
+	if (_rx_tag_resync)
+		PROBE2(resync, pos, id);
+	_rx_tag_fill = 0;
+	_rx_tag_resync = 0;
+
+	if (id != _rx_tag_source) {
+		if (_cl_dump_err) {
+			printf("%sCrosstalk, count: %lld, expected port %d, got port %d%s\n",
+					_cl_color_output ? ERROR_COLOR : NULL_COLOR,
+					pos, _rx_tag_source, id,
+					_cl_color_output ? RESET_COLOR : NULL_COLOR);
+		}
+		_crosstalk[id] += TAG_CELL_LEN;
+		_crosstalk_count += TAG_CELL_LEN;
+		rx_error(RX_ERR_CROSSTALK, pos);
+		return;
+	}
 
-		count += c;
-
-		if (c < actual_write_size) {
-			_write_count_value = _write_data[c];
+	seq = cell[2] | cell[3] << 8;
+	if (_rx_tag_synced && seq != _rx_tag_next_seq) {
+		if (_cl_dump_err) {
+			printf("%sError, count: %lld, expected cell %u, got %u%s\n",
+					_cl_color_output ? ERROR_COLOR : NULL_COLOR,
+					pos, _rx_tag_next_seq, seq,
+					_cl_color_output ? RESET_COLOR : NULL_COLOR);
 		}
-	} while (repeat);
+		_error_count++;
+		rx_error(RX_ERR_PATTERN, pos);
+	}
+	_rx_tag_synced = 1;
+	_rx_tag_next_seq = seq + 1;
+}
 
-	_write_count += count;
+/*
+ * CRC-32 (IEEE 802.3, as zlib), slice-by-8 so that framing keeps up with
+ * many ports at 4 Mbaud. ARMv8 cores with the CRC extension use the crc32
+ * instructions instead. x86 only has crc32 for the Castagnoli polynomial,
+ * so it stays on the tables.
+ */
+static uint32_t crc32_table[8][256];
+
+static void crc32_init(void)
+{
+	uint32_t i, k, c;
 
-	if (_cl_tx_detailed && count > 0)
-		printf("wrote %zd bytes\n", count);
-	return (int)count;
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (k = 0; k < 8; k++)
+			c = (c & 1) ? (c >> 1) ^ 0xedb88320 : c >> 1;
+		crc32_table[0][i] = c;
+	}
+	for (i = 0; i < 256; i++) {
+		for (k = 1; k < 8; k++) {
+			c = crc32_table[k - 1][i];
+			crc32_table[k][i] = (c >> 8) ^ crc32_table[0][c & 0xff];
+		}
+	}
 }
 
+static inline uint32_t get_le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
 
-static void setup_serial_port(int baud)
+static inline void put_le32(unsigned char *p, uint32_t v)
 {
-	struct termios newtio;
-	struct serial_rs485 rs485;
-	int ret;
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
 
-	_fd = open(_cl_port, O_RDWR | O_NONBLOCK);
+static uint32_t crc32(const unsigned char *p, size_t len)
+{
+	uint32_t crc = 0xffffffff;
 
-	if (_fd < 0) {
-		ret = -errno;
-		perror("Error opening serial port");
-		exit(ret);
-	}
+#if defined(__ARM_FEATURE_CRC32)
+	while (len >= 8) {
+		uint64_t v;
 
-	/* Lock device file */
-	if (flock(_fd, LOCK_EX | LOCK_NB) < 0) {
-		ret = -errno;
-		perror("Error failed to lock device file");
-		exit(ret);
+		memcpy(&v, p, sizeof(v));
+		crc = __crc32d(crc, v);
+		p += 8;
+		len -= 8;
 	}
+#else
+	while (len >= 8) {
+		uint32_t a = get_le32(p) ^ crc;
+		uint32_t b = get_le32(p + 4);
+
+		crc = crc32_table[7][a & 0xff] ^ crc32_table[6][(a >> 8) & 0xff] ^
+		      crc32_table[5][(a >> 16) & 0xff] ^ crc32_table[4][a >> 24] ^
+		      crc32_table[3][b & 0xff] ^ crc32_table[2][(b >> 8) & 0xff] ^
+		      crc32_table[1][(b >> 16) & 0xff] ^ crc32_table[0][b >> 24];
+		p += 8;
+		len -= 8;
+	}
+#endif
+	while (len--)
+		crc = crc32_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
 
-	bzero(&newtio, sizeof(newtio)); /* clear struct for new port settings */
-
-	/* man termios get more info on below settings */
-	newtio.c_cflag = baud | CS8 | CLOCAL | CREAD;
+	return ~crc;
+}
 
-	if (_cl_rts_cts) {
-		newtio.c_cflag |= CRTSCTS;
-	}
+/*
+ * Frame layout for --frame:
+ *   0: sync word a5 5a
+ *   2: sequence number, 32 bit little endian
+ *   6: payload, (seq + i) & 0xff
+ *   len - 4: CRC-32 of everything before it, little endian
+ */
+#define FRAME_SYNC0 0xa5
+#define FRAME_SYNC1 0x5a
+#define FRAME_HEADER_LEN 6
+#define FRAME_OVERHEAD (FRAME_HEADER_LEN + 4)
+
+long long int _tx_frame_seq = -1;
+int _rx_frame_fill = 0;
+uint32_t _rx_frame_next_seq;
+int _rx_frame_synced = 0;
+// CRC rejects since the last good frame, they account for part of its gap
+int _rx_frames_rejected = 0;
+
+static void build_frame(unsigned char *f, uint32_t seq)
+{
+	int i;
 
-	if (_cl_2_stop_bit) {
-		newtio.c_cflag |= CSTOPB;
-	}
+	f[0] = FRAME_SYNC0;
+	f[1] = FRAME_SYNC1;
+	put_le32(f + 2, seq);
+	for (i = FRAME_HEADER_LEN; i < _cl_frame_len - 4; i++)
+		f[i] = seq + i - FRAME_HEADER_LEN;
+	put_le32(f + _cl_frame_len - 4, crc32(f, _cl_frame_len - 4));
+}
 
-	if (_cl_parity) {
-		newtio.c_cflag |= PARENB;
-		if (_cl_odd_parity) {
-			newtio.c_cflag |= PARODD;
-		}
-		if (_cl_stick_parity) {
-			newtio.c_cflag |= CMSPAR;
+// fill buf with the frame stream starting at stream position pos
+static void fill_frame_data(unsigned char *buf, long long int pos, ssize_t len)
+{
+	while (len > 0) {
+		long long int seq = pos / _cl_frame_len;
+		int off = pos % _cl_frame_len;
+		ssize_t n = _cl_frame_len - off;
+
+		if (seq != _tx_frame_seq) {
+			build_frame(_tx_frame, seq);
+			_tx_frame_seq = seq;
 		}
+		if (n > len)
+			n = len;
+		memcpy(buf, _tx_frame + off, n);
+		buf += n;
+		pos += n;
+		len -= n;
 	}
+}
 
-	newtio.c_iflag = 0;
-	newtio.c_oflag = 0;
-	newtio.c_lflag = 0;
-
-	// block for up till 128 characters
-	newtio.c_cc[VMIN] = 128;
-
-	// 0.5 seconds read timeout
-	newtio.c_cc[VTIME] = 5;
+// pos is the stream position of the frame's last byte
+static void check_frame(long long int pos)
+{
+	uint32_t seq = get_le32(_rx_frame + 2);
+	int32_t gap;
 
-	/* now clean the modem line and activate the settings for the port */
-	tcflush(_fd, TCIOFLUSH);
-	tcsetattr(_fd,TCSANOW,&newtio);
+	if (!_rx_frame_synced) {
+		_rx_frame_next_seq = seq;
+		_rx_frame_synced = 1;
+	}
 
-	/* enable/disable rs485 direction control, first check if RS485 is supported */
-	if(ioctl(_fd, TIOCGRS485, &rs485) < 0) {
-		if (_cl_rs485_after_delay >= 0) {
-			/* error could be because hardware is missing rs485 support so only print when actually trying to activate it */
-			perror("Error getting RS-485 mode");
-		}
+	gap = seq - _rx_frame_next_seq;
+	if (gap < 0) {
+		// a late frame, the stream has moved past it and counted it lost
+		_frames_reordered++;
+		if (_frames_lost > 0)
+			_frames_lost--;
+		gap = 0;
 	} else {
-		if (_cl_rs485_after_delay >= 0) {
-			/* enable RS485 */
-			rs485.flags |= SER_RS485_ENABLED | SER_RS485_RX_DURING_TX |
-				(_cl_rs485_rts_after_send ? SER_RS485_RTS_AFTER_SEND : SER_RS485_RTS_ON_SEND);
-			rs485.flags &= ~(_cl_rs485_rts_after_send ? SER_RS485_RTS_ON_SEND : SER_RS485_RTS_AFTER_SEND);
-			rs485.delay_rts_after_send = _cl_rs485_after_delay;
-			rs485.delay_rts_before_send = _cl_rs485_before_delay;
-			if(ioctl(_fd, TIOCSRS485, &rs485) < 0) {
-				perror("Error setting RS-485 mode");
-			}
-		} else {
-			/* disable RS485 */
-			rs485.flags &= ~(SER_RS485_ENABLED | SER_RS485_RTS_ON_SEND | SER_RS485_RTS_AFTER_SEND);
-			rs485.delay_rts_after_send = 0;
-			rs485.delay_rts_before_send = 0;
-			if(ioctl(_fd, TIOCSRS485, &rs485) < 0) {
-				//perror("Error setting RS-232 mode");
-			}
+		/*
+		 * Frames rejected for their CRC are part of the gap, they are
+		 * not lost as well. More rejects than missing frames means the
+		 * resync tripped over sync words in a corrupted frame.
+		 */
+		if (_rx_frames_rejected > gap)
+			_frames_bad -= _rx_frames_rejected - gap;
+		gap -= _rx_frames_rejected < gap ? _rx_frames_rejected : gap;
+
+		if (gap > 0 && _cl_dump_err) {
+			printf("%sFrame error, lost %d frame(s) before seq %u%s\n",
+					_cl_color_output ? ERROR_COLOR : NULL_COLOR,
+					gap, seq,
+					_cl_color_output ? RESET_COLOR : NULL_COLOR);
 		}
+		_frames_lost += gap;
+		_rx_frame_next_seq = seq + 1;
 	}
+	_rx_frames_rejected = 0;
+	_frames_ok++;
+	_payload_bytes += _cl_frame_len - FRAME_OVERHEAD;
+
+	if (gap > 0)
+		rx_error(RX_ERR_FRAME_LOST, pos);
 }
 
-static int diff_ms(const struct timespec *t1, const struct timespec *t2)
+// look for the next sync word in the rejected frame and restart from it
+static void resync_frame(long long int pos)
 {
-	struct timespec diff;
+	int i;
 
-	diff.tv_sec = t1->tv_sec - t2->tv_sec;
-	diff.tv_nsec = t1->tv_nsec - t2->tv_nsec;
-	if (diff.tv_nsec < 0) {
-		diff.tv_sec--;
-		diff.tv_nsec += 1000000000;
+	for (i = 1; i < _rx_frame_fill; i++) {
+		if (_rx_frame[i] == FRAME_SYNC0 &&
+		    (i + 1 == _rx_frame_fill || _rx_frame[i + 1] == FRAME_SYNC1))
+			break;
 	}
-	return (diff.tv_sec * 1000 + diff.tv_nsec/1000000);
+	_rx_frame_fill -= i;
+	memmove(_rx_frame, _rx_frame + i, _rx_frame_fill);
+	PROBE2(resync, pos + 1 - _rx_frame_fill, i);
 }
 
-static int compute_error_count(void)
+// b is the byte at stream position pos
+static void frame_rx_byte(unsigned char b, long long int pos)
 {
-	long long int result;
-
-	if ((_cl_no_rx == 0 && _read_count == 0) ||
-		(_cl_no_tx == 0 && _write_count == 0)) {
-		return 127;
+	if ((_rx_frame_fill == 0 && b != FRAME_SYNC0) ||
+	    (_rx_frame_fill == 1 && b != FRAME_SYNC1)) {
+		_rx_frame_fill = (b == FRAME_SYNC0);
+		return;
 	}
 
-	if (_cl_no_rx == 1 || _cl_no_tx == 1)
-		result = _error_count;
-	else
-		result = llabs(_write_count - _read_count) + _error_count;
+	_rx_frame[_rx_frame_fill++] = b;
+	if (_rx_frame_fill < _cl_frame_len)
+		return;
 
-	return (result > 125) ? 125 : (int)result;
+	if (get_le32(_rx_frame + _cl_frame_len - 4) == crc32(_rx_frame, _cl_frame_len - 4)) {
+		check_frame(pos);
+		_rx_frame_fill = 0;
+	} else {
+		if (_cl_dump_err) {
+			printf("%sFrame error, bad CRC, count: %lld%s\n",
+					_cl_color_output ? ERROR_COLOR : NULL_COLOR,
+					pos,
+					_cl_color_output ? RESET_COLOR : NULL_COLOR);
+		}
+		_frames_bad++;
+		_rx_frames_rejected++;
+		rx_error(RX_ERR_FRAME_CRC, pos);
+		resync_frame(pos);
+	}
 }
 
-int main(int argc, char * argv[])
+static void process_frame_data(const unsigned char *rb, int c)
 {
-	atexit(&exit_handler);
+	int i;
 
-	process_options(argc, argv);
-	int runtime_no_tx = _cl_no_tx;
-	int runtime_no_rx = _cl_no_rx;
+	for (i = 0; i < c; i++)
+		frame_rx_byte(rb[i], _read_count + i);
+}
 
-	if (!_cl_port) {
-		fprintf(stderr, "ERROR: Port argument required\n");
-		display_help();
-		exit(-EINVAL);
+// hand a received data byte to the frame parser or the pattern check
+static inline void rx_data_byte(unsigned char b, long long int pos)
+{
+	if (_cl_frame_len)
+		frame_rx_byte(b, pos);
+	else if (_cl_port_tag)
+		tag_rx_byte(b, pos);
+	else
+		check_read_value(b, pos);
+}
+
+/*
+ * With INPCK | PARMRK the line discipline marks errors in-band:
+ *   \377 \0 <c>  byte c was received with a parity or framing error
+ *   \377 \0 \0   break (a parity error on a NUL byte looks the same)
+ *   \377 \377    a genuine 0xff data byte
+ * The escape may straddle two reads, so the parser state is kept across
+ * calls. Returns the number of pattern bytes consumed.
+ */
+enum {
+	MARK_NONE,
+	MARK_FF,
+	MARK_FF_00,
+};
+
+static int _mark_state = MARK_NONE;
+
+static int process_marked_data(const unsigned char *rb, int c)
+{
+	int i, n = 0;
+
+	for (i = 0; i < c; i++) {
+		unsigned char b = rb[i];
+
+		switch (_mark_state) {
+		case MARK_NONE:
+			if (b == 0xff) {
+				_mark_state = MARK_FF;
+				continue;
+			}
+			break;
+		case MARK_FF:
+			_mark_state = MARK_NONE;
+			if (b == 0x00) {
+				_mark_state = MARK_FF_00;
+				continue;
+			}
+			if (b != 0xff) {
+				// lone \377, should not happen with PARMRK
+				rx_data_byte(0xff, _read_count + n);
+				n++;
+			}
+			break;
+		case MARK_FF_00:
+			_mark_state = MARK_NONE;
+			if (b == 0x00) {
+				_break_count++;
+				if (_cl_dump_err) {
+					printf("%sBreak, count: %lld%s\n",
+							_cl_color_output ? ERROR_COLOR : NULL_COLOR,
+							_read_count + n,
+							_cl_color_output ? RESET_COLOR : NULL_COLOR);
+				}
+				rx_error(RX_ERR_BREAK, _read_count + n);
+			} else {
+				_line_error_count++;
+				if (_cl_dump_err) {
+					printf("%sParity/framing error, count: %lld, expected %02x, got %02x%s\n",
+							_cl_color_output ? ERROR_COLOR : NULL_COLOR,
+							_read_count + n, _read_count_value, b,
+							_cl_color_output ? RESET_COLOR : NULL_COLOR);
+				}
+				rx_error(RX_ERR_PARITY_FRAMING, _read_count + n);
+				// the bad byte took its slot, resync past it
+				if (_cl_frame_len || _cl_port_tag)
+					rx_data_byte(b, _read_count + n);
+				else
+					_read_count_value = next_count_value(_read_count_value);
+				n++;
+			}
+			continue;
+		}
+
+		rx_data_byte(b, _read_count + n);
+		n++;
+	}
+
+	return n;
+}
+
+/*
+ * RX/TX kernels. The generic kernels look at every option for each byte.
+ * The common run (plain pattern, no marking, framing, port tags, dumps,
+ * jitter or write-after-read) gets specialized variants instead, stamped
+ * out by the macros below for the full and the ascii range and selected
+ * once by select_kernels(). They check a whole read with one branch; on a
+ * mismatch the read is checked again by the generic kernel, which reports
+ * it exactly as before (--dump-err, --stop-on-err, resync).
+ */
+#define NEXT_FULL(v)	((unsigned char)((v) + 1))
+#define NEXT_ASCII(v)	(NEXT_FULL(v) >= 127 ? 32 : NEXT_FULL(v))
+
+// returns the number of pattern bytes consumed
+static int rx_verify_generic(const unsigned char *rb, int c)
+{
+	int i;
+
+	if (_cl_mark_errors)
+		return process_marked_data(rb, c);
+
+	if (_cl_frame_len) {
+		process_frame_data(rb, c);
+		return c;
+	}
+
+	// verify read count is incrementing
+	for (i = 0; i < c; i++)
+		rx_data_byte(rb[i], _read_count + i);
+	return c;
+}
+
+#define DEFINE_RX_VERIFY(name, NEXT)					\
+static int name(const unsigned char *rb, int c)				\
+{									\
+	unsigned char v = _read_count_value, diff = 0;			\
+	int i;								\
+									\
+	if (_read_count == 0)						\
+		return rx_verify_generic(rb, c);			\
+									\
+	for (i = 0; i < c; i++) {					\
+		diff |= rb[i] ^ v;					\
+		v = NEXT(v);						\
+	}								\
+	if (diff)							\
+		return rx_verify_generic(rb, c);			\
+									\
+	_read_count_value = v;						\
+	return c;							\
+}
+
+DEFINE_RX_VERIFY(rx_verify_full, NEXT_FULL)
+DEFINE_RX_VERIFY(rx_verify_ascii, NEXT_ASCII)
+
+#define DEFINE_PROCESS_READ(name, VERIFY, GENERIC)			\
+static int name(void)							\
+{									\
+	unsigned char rb[_read_size];					\
+	int c = read(_fd, &rb, sizeof(rb));				\
+	if (c > 0) {							\
+		_rx_first_error = -1;					\
+									\
+		if (GENERIC && _cl_rx_jitter) {				\
+			struct timespec now;				\
+									\
+			clock_gettime(CLOCK_MONOTONIC, &now);		\
+			if (_read_size_hist.count)			\
+				hist_add(&_read_gap_hist, diff_us(&now, &_last_rx_time)); \
+			hist_add(&_read_size_hist, c);			\
+			_last_rx_time = now;				\
+		}							\
+									\
+		if (GENERIC && _cl_rx_dump) {				\
+			if (_cl_rx_dump_ascii)				\
+				dump_data_ascii(rb, c);			\
+			else						\
+				dump_data(rb, c);			\
+		}							\
+									\
+		int consumed = VERIFY(rb, c);				\
+									\
+		PROBE2(read, c, _rx_first_error < 0 ? -1 : _rx_first_error - _read_count); \
+		_read_count += consumed;				\
+	}								\
+	return c;							\
+}
+
+DEFINE_PROCESS_READ(process_read_data_generic, rx_verify_generic, 1)
+DEFINE_PROCESS_READ(process_read_data_full, rx_verify_full, 0)
+DEFINE_PROCESS_READ(process_read_data_ascii, rx_verify_ascii, 0)
+
+/*
+ * Adaptive TX: return how much can be written to bring the TX queue up to
+ * its target depth. Once the queue is at the target, poll() still reports
+ * it writable, so hold off writing until a quarter of the target drained.
+ */
+static ssize_t adaptive_write_room(void)
+{
+	int outq, target;
+
+	if (ioctl(_fd, TIOCOUTQ, &outq) < 0)
+		outq = 0;
+	if (outq > _tx_queue_size)
+		_tx_queue_size = outq;
+
+	target = _cl_tx_adaptive > 0 ? _cl_tx_adaptive : _tx_queue_size;
+	if (outq < target)
+		return target - outq;
+
+	clock_gettime(CLOCK_MONOTONIC, &_tx_resume_time);
+	timespec_add_ns(&_tx_resume_time, (outq - target + target / 4) * char_time_ns());
+	_tx_hold = 1;
+	return 0;
+}
+
+// fill n bytes of _write_data, starting at stream position pos
+static void tx_fill_generic(long long int pos, ssize_t n)
+{
+	ssize_t i;
+
+	if (_cl_frame_len) {
+		fill_frame_data(_write_data, pos, n);
+		return;
+	}
+
+	if (_cl_port_tag) {
+		fill_tag_data(_write_data, pos, n);
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		_write_data[i] = _write_count_value;
+		_write_count_value = next_count_value(_write_count_value);
+	}
+}
+
+#define DEFINE_TX_FILL(name, NEXT)					\
+static void name(long long int pos, ssize_t n)				\
+{									\
+	unsigned char *wb = _write_data, v = _write_count_value;	\
+	ssize_t i;							\
+									\
+	(void)pos;							\
+	for (i = 0; i < n; i++) {					\
+		wb[i] = v;						\
+		v = NEXT(v);						\
+	}								\
+	_write_count_value = v;						\
+}
+
+DEFINE_TX_FILL(tx_fill_full, NEXT_FULL)
+DEFINE_TX_FILL(tx_fill_ascii, NEXT_ASCII)
+
+#define DEFINE_PROCESS_WRITE(name, FILL, GENERIC)			\
+static int name(void)							\
+{									\
+	ssize_t count = 0;						\
+	ssize_t actual_write_size = 0;					\
+	ssize_t room = _write_size;					\
+	int repeat = (_cl_tx_bytes == 0 && (!GENERIC || _cl_tx_adaptive < 0)); \
+									\
+	if (GENERIC && _cl_tx_adaptive >= 0) {				\
+		room = adaptive_write_room();				\
+		if (room == 0)						\
+			return 0;					\
+	}								\
+									\
+	do								\
+	{								\
+		if (!GENERIC || _cl_write_after_read == 0) {		\
+			actual_write_size = _write_size;		\
+		} else {						\
+			actual_write_size = _read_count > _write_count ? _read_count - _write_count : 0; \
+			if (actual_write_size > _write_size) {		\
+				actual_write_size = _write_size;	\
+			}						\
+			/* echo the pattern as the read side resynced to it */ \
+			if (!_cl_frame_len && !_cl_port_tag)		\
+				_write_count_value = prev_count_value(_read_count_value, \
+					_read_count - _write_count - count); \
+		}							\
+		if (actual_write_size > room) {				\
+			actual_write_size = room;			\
+		}							\
+		if (actual_write_size == 0) {				\
+			break;						\
+		}							\
+									\
+		FILL(_write_count + count, actual_write_size);		\
+									\
+		ssize_t c = write(_fd, _write_data, actual_write_size);	\
+									\
+		PROBE3(write, actual_write_size, c, c < 0 && errno == EAGAIN); \
+									\
+		if (c < 0) {						\
+			if (errno != EAGAIN) {				\
+				printf("write failed - errno=%d (%s)\n", errno, strerror(errno)); \
+			} else {					\
+				_write_eagain_count++;			\
+			}						\
+			c = 0;						\
+		} else {						\
+			_write_calls++;					\
+			if (GENERIC && _cl_tx_adaptive >= 0)		\
+				hist_add(&_write_size_hist, c);		\
+			repeat = 0;					\
+		}							\
+									\
+		count += c;						\
+									\
+		if (c < actual_write_size && !(GENERIC && (_cl_frame_len || _cl_port_tag))) { \
+			_write_count_value = _write_data[c];		\
+		}							\
+	} while (repeat);						\
+									\
+	_write_count += count;						\
+									\
+	if (GENERIC && _cl_tx_detailed && count > 0)			\
+		printf("wrote %zd bytes\n", count);			\
+	return (int)count;						\
+}
+
+DEFINE_PROCESS_WRITE(process_write_data_generic, tx_fill_generic, 1)
+DEFINE_PROCESS_WRITE(process_write_data_full, tx_fill_full, 0)
+DEFINE_PROCESS_WRITE(process_write_data_ascii, tx_fill_ascii, 0)
+
+static int (*_process_read_data)(void) = process_read_data_generic;
+static int (*_process_write_data)(void) = process_write_data_generic;
+
+static void select_kernels(void)
+{
+	int plain = !_cl_mark_errors && !_cl_frame_len && !_cl_port_tag;
+
+	if (plain && !_cl_rx_dump && !_cl_rx_jitter)
+		_process_read_data = _cl_ascii_range ? process_read_data_ascii : process_read_data_full;
+
+	if (plain && !_cl_write_after_read && !_cl_tx_detailed && _cl_tx_adaptive < 0)
+		_process_write_data = _cl_ascii_range ? process_write_data_ascii : process_write_data_full;
+}
+
+/*
+ * --kernel-bench: time the generic and the specialized kernels on an
+ * in-memory stream, without syscalls, and check that they agree.
+ */
+#define BENCH_STREAM	(256 * 95)	// a whole number of full and ascii periods
+#define BENCH_CHUNK	(BENCH_STREAM / 20)
+#define BENCH_BYTES	(64LL << 20)
+
+static double bench_rx(int (*verify)(const unsigned char *, int), const unsigned char *stream)
+{
+	struct timespec t0, t1;
+	long long int done;
+
+	_read_count = 1;
+	_read_count_value = stream[1];
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (done = 0; done < BENCH_BYTES; done += BENCH_CHUNK)
+		_read_count += verify(stream + 1 + done % BENCH_STREAM, BENCH_CHUNK);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	return (double)diff_us(&t1, &t0) * 1000 / BENCH_BYTES;
+}
+
+static double bench_tx(void (*fill)(long long int, ssize_t))
+{
+	struct timespec t0, t1;
+	long long int done;
+
+	_write_count_value = _cl_ascii_range ? 32 : 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (done = 0; done < BENCH_BYTES; done += BENCH_CHUNK)
+		fill(done, BENCH_CHUNK);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	return (double)diff_us(&t1, &t0) * 1000 / BENCH_BYTES;
+}
+
+static int run_kernel_bench(void)
+{
+	static const struct {
+		const char *name;
+		int ascii;
+		int (*verify)(const unsigned char *, int);
+		void (*fill)(long long int, ssize_t);
+	} kernels[] = {
+		{ "full range", 0, rx_verify_full, tx_fill_full },
+		{ "ascii range", 1, rx_verify_ascii, tx_fill_ascii },
+	};
+	unsigned char stream[BENCH_STREAM + BENCH_CHUNK + 1];
+	unsigned char filled[BENCH_CHUNK];
+	int k, mismatch = 0;
+
+	_write_size = BENCH_CHUNK;
+	_write_data = malloc(_write_size);
+	if (_write_data == NULL) {
+		fprintf(stderr, "ERROR: Memory allocation failed\n");
+		exit(-ENOMEM);
+	}
+
+	for (k = 0; k < (int)(sizeof(kernels) / sizeof(kernels[0])); k++) {
+		double generic, special;
+		unsigned char expect;
+		size_t i;
+
+		_cl_ascii_range = kernels[k].ascii;
+		_write_count_value = _cl_ascii_range ? 32 : 0;
+		for (i = 0; i < sizeof(stream); i++) {
+			stream[i] = _write_count_value;
+			_write_count_value = next_count_value(_write_count_value);
+		}
+
+		// both kernels must leave the same state behind
+		_error_count = 0;
+		generic = bench_rx(rx_verify_generic, stream);
+		expect = _read_count_value;
+		special = bench_rx(kernels[k].verify, stream);
+		if (_read_count_value != expect || _error_count)
+			mismatch = 1;
+		printf("%s: rx generic %.3f ns/byte, specialized %.3f ns/byte, %.1fx\n",
+				kernels[k].name, generic, special, special > 0 ? generic / special : 0);
+
+		generic = bench_tx(tx_fill_generic);
+		expect = _write_count_value;
+		memcpy(filled, _write_data, BENCH_CHUNK);
+		special = bench_tx(kernels[k].fill);
+		if (_write_count_value != expect || memcmp(_write_data, filled, BENCH_CHUNK))
+			mismatch = 1;
+		printf("%s: tx generic %.3f ns/byte, specialized %.3f ns/byte, %.1fx\n",
+				kernels[k].name, generic, special, special > 0 ? generic / special : 0);
+	}
+
+	if (mismatch) {
+		printf("%sERROR: specialized kernels disagree with the generic ones%s\n",
+				_cl_color_output ? ERROR_COLOR : NULL_COLOR,
+				_cl_color_output ? RESET_COLOR : NULL_COLOR);
+		return -EIO;
+	}
+	return 0;
+}
+
+/*
+ * Flow control reaction: while a line is deasserted, track the byte
+ * counter it is supposed to stop (rx for our RTS, tx for the CTS we
+ * obey). Bytes counted after the deassert are the overshoot, and the
+ * time of the last one is the reaction latency.
+ */
+struct flow_watch {
+	int level;		// last seen line level, -1 until first sample
+	struct timespec t_deassert;
+	struct timespec t_last;
+	unsigned int count_start;
+	unsigned int count_last;
+	struct histogram overshoot;
+	struct histogram latency;
+};
+
+struct flow_watch _rts_watch = {
+	.level = -1,
+	.overshoot = { .name = "rx after RTS deassert", .unit = "bytes" },
+	.latency = { .name = "RTS reaction latency", .unit = "us" },
+};
+
+struct flow_watch _cts_watch = {
+	.level = -1,
+	.overshoot = { .name = "tx after CTS deassert", .unit = "bytes" },
+	.latency = { .name = "CTS reaction latency", .unit = "us" },
+};
+
+pthread_t _flow_thread;
+int _flow_thread_running = 0;
+
+/*
+ * CTS is an input, so its edges come from TIOCMIWAIT on their own thread
+ * and are compared with the icount CTS transitions to find windows that
+ * were too short to see. Where the driver cannot wait on modem lines CTS
+ * is sampled with RTS. _flow_lock guards _cts_watch between the threads.
+ */
+pthread_t _cts_thread;
+int _cts_thread_running = 0;
+pthread_mutex_t _flow_lock = PTHREAD_MUTEX_INITIALIZER;
+int _cts_sampled = 1;
+unsigned int _cts_transitions;
+long long int _cts_missed = 0;
+
+static void flow_watch_end(struct flow_watch *w)
+{
+	unsigned int bytes = w->count_last - w->count_start;
+
+	hist_add(&w->overshoot, bytes);
+	hist_add(&w->latency, bytes ? diff_us(&w->t_last, &w->t_deassert) : 0);
+}
+
+// inside a window: note when the counter last moved
+static void flow_watch_progress(struct flow_watch *w, unsigned int count,
+		const struct timespec *now)
+{
+	if (count != w->count_last) {
+		w->count_last = count;
+		w->t_last = *now;
+	}
+}
+
+static void flow_watch_update(struct flow_watch *w, int level, unsigned int count,
+		const struct timespec *now)
+{
+	if (w->level == 0) {
+		flow_watch_progress(w, count, now);
+		if (level)
+			flow_watch_end(w);
+	} else if (w->level == 1 && !level) {
+		w->t_deassert = *now;
+		w->t_last = *now;
+		w->count_start = count;
+		w->count_last = count;
+	}
+	w->level = level;
+}
+
+// call with _flow_lock held
+static void cts_watch_update(int level, const struct serial_icounter_struct *icount,
+		const struct timespec *now)
+{
+	if (_cts_watch.level >= 0) {
+		unsigned int changes = icount->cts - _cts_transitions;
+		unsigned int seen = level != _cts_watch.level;
+
+		if (changes > seen)
+			_cts_missed += changes - seen;
+	}
+	_cts_transitions = icount->cts;
+	flow_watch_update(&_cts_watch, level, icount->tx, now);
+}
+
+static void cts_watch_wakeup(int sig)
+{
+}
+
+static void *cts_watch_thread(void *arg)
+{
+	while (!_helpers_stop) {
+		struct serial_icounter_struct icount;
+		struct timespec now;
+		int status;
+
+		if (ioctl(_fd, TIOCMGET, &status) < 0 || ioctl(_fd, TIOCGICOUNT, &icount) < 0)
+			break;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		pthread_mutex_lock(&_flow_lock);
+		cts_watch_update(!!(status & TIOCM_CTS), &icount, &now);
+		_cts_sampled = 0;
+		pthread_mutex_unlock(&_flow_lock);
+
+		if (_helpers_stop)
+			break;
+		if (ioctl(_fd, TIOCMIWAIT, TIOCM_CTS) < 0 && errno != EINTR) {
+			// the driver cannot wait on modem lines, leave CTS to sampling
+			pthread_mutex_lock(&_flow_lock);
+			_cts_sampled = 1;
+			pthread_mutex_unlock(&_flow_lock);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * TIOCMIWAIT only reports input lines, so it would never see our own RTS
+ * drop; sample RTS with TIOCMGET instead. While a CTS window is open the
+ * TX counter is sampled here too.
+ */
+static void *flow_watch_thread(void *arg)
+{
+	struct timespec period = {
+		.tv_sec = _cl_flow_latency / 1000000,
+		.tv_nsec = (_cl_flow_latency % 1000000) * 1000,
+	};
+
+	while (!_helpers_stop) {
+		struct serial_icounter_struct icount;
+		struct timespec now;
+		int status;
+
+		if (ioctl(_fd, TIOCMGET, &status) < 0) {
+			perror("flow latency: TIOCMGET failed");
+			break;
+		}
+		if (ioctl(_fd, TIOCGICOUNT, &icount) < 0) {
+			perror("flow latency: TIOCGICOUNT failed");
+			break;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		flow_watch_update(&_rts_watch, !!(status & TIOCM_RTS), icount.rx, &now);
+
+		pthread_mutex_lock(&_flow_lock);
+		if (_cts_sampled)
+			cts_watch_update(!!(status & TIOCM_CTS), &icount, &now);
+		else if (_cts_watch.level == 0)
+			flow_watch_progress(&_cts_watch, icount.tx, &now);
+		pthread_mutex_unlock(&_flow_lock);
+
+		nanosleep(&period, NULL);
+	}
+
+	// close a window still open at the end of the test
+	if (_rts_watch.level == 0)
+		flow_watch_end(&_rts_watch);
+	if (_cts_watch.level == 0)
+		flow_watch_end(&_cts_watch);
+
+	return NULL;
+}
+
+/*
+ * Queue telemetry: TIOCOUTQ/TIOCINQ sampled from a timerfd so that the
+ * sample rate does not depend on the poll loop. A queue counts as full
+ * when less than 1/16 of it is free. The TX size starts at a page (the
+ * UART circular buffer) and grows if a driver reports more; the RX size
+ * is the n_tty read buffer.
+ */
+#define N_TTY_BUF_SIZE 4096
+
+struct queue_watch {
+	int size;
+	long long int full_us;
+	long long int empty_us;
+	long long int total_us;
+	struct histogram depth;
+};
+
+struct queue_watch _tx_queue = {
+	.depth = { .name = "tx queue depth", .unit = "bytes" },
+};
+
+struct queue_watch _rx_queue = {
+	.size = N_TTY_BUF_SIZE,
+	.depth = { .name = "rx queue depth", .unit = "bytes" },
+};
+
+pthread_t _queue_thread;
+int _queue_thread_running = 0;
+
+static void queue_watch_update(struct queue_watch *q, int depth, long long int us)
+{
+	if (depth > q->size)
+		q->size = depth;
+
+	hist_add(&q->depth, depth);
+	q->total_us += us;
+	if (depth == 0)
+		q->empty_us += us;
+	else if (depth >= q->size - q->size / 16)
+		q->full_us += us;
+}
+
+static void *queue_watch_thread(void *arg)
+{
+	struct itimerspec its;
+	int tfd;
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (tfd < 0) {
+		perror("queue sample: timerfd_create failed");
+		return NULL;
+	}
+
+	its.it_interval.tv_sec = _cl_queue_sample / 1000000;
+	its.it_interval.tv_nsec = (_cl_queue_sample % 1000000) * 1000;
+	its.it_value = its.it_interval;
+	if (timerfd_settime(tfd, 0, &its, NULL) < 0) {
+		perror("queue sample: timerfd_settime failed");
+		close(tfd);
+		return NULL;
+	}
+
+	while (!_helpers_stop) {
+		uint64_t expirations;
+		int outq, inq;
+		long long int us;
+
+		if (read(tfd, &expirations, sizeof(expirations)) != sizeof(expirations))
+			continue;
+
+		if (ioctl(_fd, TIOCOUTQ, &outq) < 0) {
+			perror("queue sample: TIOCOUTQ failed");
+			break;
+		}
+		if (ioctl(_fd, TIOCINQ, &inq) < 0) {
+			perror("queue sample: TIOCINQ failed");
+			break;
+		}
+
+		// a late wakeup stands in for the samples it missed
+		us = (long long int)expirations * _cl_queue_sample;
+		queue_watch_update(&_tx_queue, outq, us);
+		queue_watch_update(&_rx_queue, inq, us);
+	}
+
+	close(tfd);
+	return NULL;
+}
+
+static void dump_queue_watch(const char *name, const struct queue_watch *q)
+{
+	if (q->total_us == 0)
+		return;
+
+	printf("%s: %s queue (%d bytes): full %lld ms (%lld%%), empty %lld ms (%lld%%)\n",
+		_cl_port, name, q->size,
+		q->full_us / 1000, q->full_us * 100 / q->total_us,
+		q->empty_us / 1000, q->empty_us * 100 / q->total_us);
+}
+
+/*
+ * Emulated UART endpoint (--emulate): the far end of a pty is served by a
+ * helper thread that acts as a loopback cable into a UART. Bytes we write
+ * are moved at the line rate, go through fault injection and land in a
+ * receive FIFO of the given depth, which drains into the pty. When the
+ * reader stalls and the pty buffer fills up, the FIFO overruns, or with
+ * -c holds back the sender the way RTS would. Faults are drawn per byte
+ * from a seeded generator, so a run is reproducible.
+ *
+ * A pty cannot carry break or parity flags, so a break arrives as the NUL
+ * byte n_tty delivers for it without PARMRK.
+ */
+#define EMU_MAX_FIFO 4096
+
+struct emulator {
+	int master;
+	int slave;
+	int fifo_size;
+	double drop_rate;
+	double flip_rate;
+	double break_rate;
+	double settle_ms;
+	double tail_ms;
+	double turnaround_ms;
+	uint64_t rng;
+	unsigned char fifo[EMU_MAX_FIFO];
+	int fifo_head;
+	int fifo_count;
+	long long int line_bytes;
+	long long int dropped;
+	long long int flipped;
+	long long int breaks;
+	long long int overruns;
+};
+
+struct emulator _emu = {
+	.master = -1,
+	.slave = -1,
+	.fifo_size = 16,
+	.settle_ms = 1,
+	.tail_ms = 1,
+	.turnaround_ms = 3,
+	.rng = 1,
+};
+
+pthread_t _emu_thread;
+int _emu_thread_running = 0;
+
+static void close_emulator(void)
+{
+	if (_emu.master >= 0) {
+		close(_emu.master);
+		close(_emu.slave);
+		_emu.master = -1;
+	}
+}
+
+static void setup_emulator(void)
+{
+	int ret;
+	char *name;
+
+	_emu.master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (_emu.master < 0 || grantpt(_emu.master) < 0 || unlockpt(_emu.master) < 0 ||
+	    (name = ptsname(_emu.master)) == NULL) {
+		ret = -errno;
+		perror("Error creating emulator pty");
+		exit(ret);
+	}
+
+	// keep the slave open so the master never sees a hangup
+	_emu.slave = open(name, O_RDWR | O_NOCTTY);
+	if (_emu.slave < 0) {
+		ret = -errno;
+		perror("Error opening emulator pty");
+		exit(ret);
+	}
+
+	free(_cl_port);
+	_cl_port = strdup(name);
+	printf("Emulated UART on %s\n", _cl_port);
+}
+
+// xorshift64*, good enough for fault injection and cheap per byte
+static double emu_random(void)
+{
+	_emu.rng ^= _emu.rng >> 12;
+	_emu.rng ^= _emu.rng << 25;
+	_emu.rng ^= _emu.rng >> 27;
+	return ((_emu.rng * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// apply the configured faults to a byte on the line, 0 if it was lost
+static int emu_fault(unsigned char *b)
+{
+	if (_emu.drop_rate > 0 && emu_random() < _emu.drop_rate) {
+		_emu.dropped++;
+		return 0;
+	}
+	if (_emu.break_rate > 0 && emu_random() < _emu.break_rate) {
+		*b = 0;
+		_emu.breaks++;
+	} else if (_emu.flip_rate > 0 && emu_random() < _emu.flip_rate) {
+		*b ^= 1 << (int)(emu_random() * 8);
+		_emu.flipped++;
+	}
+	return 1;
+}
+
+static void emu_drain(int *master_full)
+{
+	while (_emu.fifo_count) {
+		int n = _emu.fifo_count;
+		ssize_t w;
+
+		if (n > EMU_MAX_FIFO - _emu.fifo_head)
+			n = EMU_MAX_FIFO - _emu.fifo_head;
+		w = write(_emu.master, _emu.fifo + _emu.fifo_head, n);
+		if (w <= 0) {
+			*master_full = 1;
+			return;
+		}
+		_emu.fifo_head = (_emu.fifo_head + w) % EMU_MAX_FIFO;
+		_emu.fifo_count -= w;
+		if (w < n) {
+			*master_full = 1;
+			return;
+		}
+	}
+}
+
+static void emu_push(unsigned char b, int *master_full)
+{
+	if (_emu.fifo_count == _emu.fifo_size && !*master_full)
+		emu_drain(master_full);
+	if (_emu.fifo_count == _emu.fifo_size) {
+		_emu.overruns++;
+		return;
+	}
+	_emu.fifo[(_emu.fifo_head + _emu.fifo_count) % EMU_MAX_FIFO] = b;
+	_emu.fifo_count++;
+}
+
+static long long int now_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static void *emulator_thread(void *arg)
+{
+	long long int char_ns = char_time_ns();
+	long long int sleep_ns = char_ns * _emu.fifo_size / 2;
+	long long int t_line = now_ns();
+	unsigned char buf[EMU_MAX_FIFO];
+
+	// wake often enough not to overrun an idle FIFO, but not for every byte
+	if (sleep_ns < 50000)
+		sleep_ns = 50000;
+	if (sleep_ns > 1000000)
+		sleep_ns = 1000000;
+
+	while (!_helpers_stop) {
+		struct timespec period = { 0, sleep_ns };
+		long long int now = now_ns();
+		long long int due = (now - t_line) / char_ns;
+		long long int n = due;
+		int master_full = 0;
+		ssize_t i, r = 0;
+
+		emu_drain(&master_full);
+
+		// with flow control a full FIFO deasserts RTS towards the sender
+		if (_cl_rts_cts && n > _emu.fifo_size - _emu.fifo_count)
+			n = _emu.fifo_size - _emu.fifo_count;
+		if (n > (long long int)sizeof(buf))
+			n = sizeof(buf);
+
+		if (n > 0) {
+			r = read(_emu.master, buf, n);
+			for (i = 0; i < r; i++) {
+				if (emu_fault(&buf[i]))
+					emu_push(buf[i], &master_full);
+			}
+			if (r > 0) {
+				_emu.line_bytes += r;
+				t_line += r * char_ns;
+			}
+		}
+		// an idle or held off line does not save up time for later
+		if (n < due || r < n)
+			t_line = now;
+
+		emu_drain(&master_full);
+		nanosleep(&period, NULL);
+	}
+
+	return NULL;
+}
+
+/*
+ * Half duplex echo peer for --rs485-bench. It reads the delay settings
+ * the bench applies, since a pty has no TIOCSRS485, and models the bus:
+ * - our driver needs settle_ms after enable, so a shorter
+ *   delay_rts_before_send garbles the first byte of the request;
+ * - it needs tail_ms after the last byte, so a shorter
+ *   delay_rts_after_send cuts off the last byte;
+ * - the peer echoes what it got turnaround_ms after the request, and reply
+ *   bytes that start while our driver is still enabled collide.
+ */
+static void emu_sleep_until(long long int t)
+{
+	struct timespec ts = { t / 1000000000, t % 1000000000 };
+
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+static void *emulator_rs485_thread(void *arg)
+{
+	long long int char_ns = char_time_ns();
+	unsigned char buf[EMU_MAX_FIFO];
+
+	while (!_helpers_stop) {
+		struct timespec idle = { 0, 100000 };
+		long long int t_start, t_end, t_reply, t_release, collide;
+		ssize_t n = 0, r, i;
+
+		r = read(_emu.master, buf, sizeof(buf));
+		if (r <= 0) {
+			nanosleep(&idle, NULL);
+			continue;
+		}
+
+		// our driver is enabled when the first byte shows up
+		t_start = now_ns() + _cl_rs485_before_delay * 1000000LL;
+
+		// collect the rest of the request until the line goes quiet
+		do {
+			n += r;
+			emu_sleep_until(now_ns() + (char_ns > 100000 ? char_ns : 100000));
+			r = read(_emu.master, buf + n, sizeof(buf) - n);
+		} while (r > 0 && n < (ssize_t)sizeof(buf));
+
+		t_end = t_start + n * char_ns;
+		_emu.line_bytes += n;
+
+		if (_cl_rs485_before_delay < _emu.settle_ms) {
+			buf[0] = ~buf[0];
+			_emu.flipped++;
+		}
+		if (_cl_rs485_after_delay < _emu.tail_ms) {
+			n--;
+			_emu.dropped++;
+		}
+
+		t_reply = t_end + _emu.turnaround_ms * 1000000;
+		t_release = t_end + _cl_rs485_after_delay * 1000000LL;
+		collide = t_release > t_reply ? (t_release - t_reply + char_ns - 1) / char_ns : 0;
+		for (i = 0; i < n && i < collide; i++) {
+			buf[i] ^= 0xff;
+			_emu.flipped++;
+		}
+
+		// hand over the reply once its last byte is off the line
+		emu_sleep_until(t_reply + n * char_ns);
+		for (i = 0; i < n; ) {
+			r = write(_emu.master, buf + i, n - i);
+			if (r <= 0) {
+				_emu.overruns += n - i;
+				break;
+			}
+			i += r;
+		}
+	}
+
+	return NULL;
+}
+
+static void parse_emulate_options(char *arg)
+{
+	enum {
+		EMU_FIFO,
+		EMU_DROP,
+		EMU_FLIP,
+		EMU_BREAK,
+		EMU_SEED,
+		EMU_SETTLE,
+		EMU_TAIL,
+		EMU_TURNAROUND,
+	};
+	char *const tokens[] = {
+		[EMU_FIFO] = "fifo",
+		[EMU_DROP] = "drop",
+		[EMU_FLIP] = "flip",
+		[EMU_BREAK] = "break",
+		[EMU_SEED] = "seed",
+		[EMU_SETTLE] = "settle",
+		[EMU_TAIL] = "tail",
+		[EMU_TURNAROUND] = "turnaround",
+		NULL,
+	};
+	char *value;
+
+	while (*arg) {
+		char *opt = arg;
+		int token = getsubopt(&arg, tokens, &value);
+
+		if (token < 0) {
+			fprintf(stderr, "ERROR: unknown --emulate option '%s'\n", opt);
+			exit(-EINVAL);
+		}
+		if (value == NULL) {
+			fprintf(stderr, "ERROR: --emulate option '%s' needs a value\n", opt);
+			exit(-EINVAL);
+		}
+
+		switch (token) {
+		case EMU_FIFO:
+			_emu.fifo_size = strtol(value, NULL, 0);
+			if (_emu.fifo_size < 1 || _emu.fifo_size > EMU_MAX_FIFO) {
+				fprintf(stderr, "ERROR: --emulate fifo must be 1 to %d bytes\n", EMU_MAX_FIFO);
+				exit(-EINVAL);
+			}
+			break;
+		case EMU_DROP:
+			_emu.drop_rate = strtod(value, NULL);
+			break;
+		case EMU_FLIP:
+			_emu.flip_rate = strtod(value, NULL);
+			break;
+		case EMU_BREAK:
+			_emu.break_rate = strtod(value, NULL);
+			break;
+		case EMU_SEED:
+			// xorshift must not start from zero
+			_emu.rng = strtoull(value, NULL, 0) ?: 1;
+			break;
+		case EMU_SETTLE:
+			_emu.settle_ms = strtod(value, NULL);
+			break;
+		case EMU_TAIL:
+			_emu.tail_ms = strtod(value, NULL);
+			break;
+		case EMU_TURNAROUND:
+			_emu.turnaround_ms = strtod(value, NULL);
+			break;
+		}
+	}
+}
+
+static void dump_emulator_stats(void)
+{
+	printf("%s: emulator: line=%lld, dropped=%lld, flipped=%lld, breaks=%lld, overruns=%lld\n",
+		_cl_port, _emu.line_bytes, _emu.dropped, _emu.flipped, _emu.breaks,
+		_emu.overruns);
+}
+
+static void start_helper(pthread_t *thread, void *(*fn)(void *), int *running)
+{
+	int ret;
+
+	ret = pthread_create(thread, NULL, fn, NULL);
+	if (ret) {
+		fprintf(stderr, "ERROR: failed to start helper thread: %s\n", strerror(ret));
+		exit(-ret);
+	}
+	*running = 1;
+}
+
+static void stop_helper(pthread_t thread, int *running)
+{
+	if (*running) {
+		pthread_join(thread, NULL);
+		*running = 0;
+	}
+}
+
+static void start_helpers(void)
+{
+	if (_cl_emulate)
+		start_helper(&_emu_thread, _cl_rs485_bench ? emulator_rs485_thread : emulator_thread,
+				&_emu_thread_running);
+	if (_cl_flow_latency > 0) {
+		struct sigaction sa = { .sa_handler = cts_watch_wakeup };
+
+		// no SA_RESTART, so that stopping interrupts TIOCMIWAIT
+		sigaction(SIGUSR1, &sa, NULL);
+		start_helper(&_cts_thread, cts_watch_thread, &_cts_thread_running);
+		start_helper(&_flow_thread, flow_watch_thread, &_flow_thread_running);
+	}
+	if (_cl_queue_sample > 0)
+		start_helper(&_queue_thread, queue_watch_thread, &_queue_thread_running);
+}
+
+static void stop_helpers(void)
+{
+	_helpers_stop = 1;
+
+	if (_cts_thread_running) {
+		// the thread may only enter TIOCMIWAIT after a wakeup, so repeat it
+		while (pthread_tryjoin_np(_cts_thread, NULL) == EBUSY) {
+			pthread_kill(_cts_thread, SIGUSR1);
+			usleep(1000);
+		}
+		_cts_thread_running = 0;
+	}
+	stop_helper(_flow_thread, &_flow_thread_running);
+	stop_helper(_queue_thread, &_queue_thread_running);
+	stop_helper(_emu_thread, &_emu_thread_running);
+}
+
+static void dump_final_stats(void)
+{
+	if (_cl_flow_latency > 0) {
+		hist_dump(&_rts_watch.overshoot);
+		hist_dump(&_rts_watch.latency);
+		hist_dump(&_cts_watch.overshoot);
+		hist_dump(&_cts_watch.latency);
+		printf("%s%s: CTS %s, transitions too short to see: %lld%s\n",
+			_cl_color_output && _cts_missed > 0 ? ERROR_COLOR : NULL_COLOR,
+			_cl_port, _cts_sampled ? "sampled" : "from TIOCMIWAIT", _cts_missed,
+			_cl_color_output ? RESET_COLOR : NULL_COLOR);
+	}
+
+	if (_cl_tx_adaptive >= 0)
+		hist_dump(&_write_size_hist);
+
+	if (_cl_rx_jitter) {
+		hist_dump(&_read_gap_hist);
+		hist_dump(&_read_size_hist);
+	}
+
+	if (_cl_emulate)
+		dump_emulator_stats();
+
+	if (_cl_queue_sample > 0) {
+		hist_dump(&_tx_queue.depth);
+		dump_queue_watch("tx", &_tx_queue);
+		hist_dump(&_rx_queue.depth);
+		dump_queue_watch("rx", &_rx_queue);
+	}
+}
+
+static void setup_serial_port(int baud)
+{
+	struct termios newtio;
+	struct serial_rs485 rs485;
+	int ret;
+
+	_fd = open(_cl_port, O_RDWR | O_NONBLOCK);
+
+	if (_fd < 0) {
+		ret = -errno;
+		perror("Error opening serial port");
+		exit(ret);
+	}
+
+	/* Lock device file */
+	if (flock(_fd, LOCK_EX | LOCK_NB) < 0) {
+		ret = -errno;
+		perror("Error failed to lock device file");
+		exit(ret);
+	}
+
+	bzero(&newtio, sizeof(newtio)); /* clear struct for new port settings */
+
+	/* man termios get more info on below settings */
+	newtio.c_cflag = baud | CS8 | CLOCAL | CREAD;
+
+	if (_cl_rts_cts) {
+		newtio.c_cflag |= CRTSCTS;
+	}
+
+	if (_cl_2_stop_bit) {
+		newtio.c_cflag |= CSTOPB;
+	}
+
+	if (_cl_parity) {
+		newtio.c_cflag |= PARENB;
+		if (_cl_odd_parity) {
+			newtio.c_cflag |= PARODD;
+		}
+		if (_cl_stick_parity) {
+			newtio.c_cflag |= CMSPAR;
+		}
+	}
+
+	if (_cl_mark_errors) {
+		// report parity/framing errors and breaks in-band, see process_marked_data()
+		newtio.c_iflag = INPCK | PARMRK;
+	} else {
+		newtio.c_iflag = 0;
+	}
+	newtio.c_oflag = 0;
+	newtio.c_lflag = 0;
+
+	// block for up till 128 characters
+	newtio.c_cc[VMIN] = 128;
+
+	// 0.5 seconds read timeout
+	newtio.c_cc[VTIME] = 5;
+
+	/* now clean the modem line and activate the settings for the port */
+	tcflush(_fd, TCIOFLUSH);
+	tcsetattr(_fd,TCSANOW,&newtio);
+
+	if (_cl_mark_errors && ioctl(_fd, TIOCGICOUNT, &_icount_start) == 0) {
+		_icount_start_valid = 1;
+	}
+
+	/* enable/disable rs485 direction control, first check if RS485 is supported */
+	if(ioctl(_fd, TIOCGRS485, &rs485) < 0) {
+		if (_cl_rs485_after_delay >= 0) {
+			/* error could be because hardware is missing rs485 support so only print when actually trying to activate it */
+			perror("Error getting RS-485 mode");
+		}
+	} else {
+		if (_cl_rs485_after_delay >= 0) {
+			/* enable RS485 */
+			rs485.flags |= SER_RS485_ENABLED | SER_RS485_RX_DURING_TX |
+				(_cl_rs485_rts_after_send ? SER_RS485_RTS_AFTER_SEND : SER_RS485_RTS_ON_SEND);
+			rs485.flags &= ~(_cl_rs485_rts_after_send ? SER_RS485_RTS_ON_SEND : SER_RS485_RTS_AFTER_SEND);
+			/* an echo peer (-K) would hear its own replies and echo them again */
+			if (_cl_write_after_read)
+				rs485.flags &= ~SER_RS485_RX_DURING_TX;
+			rs485.delay_rts_after_send = _cl_rs485_after_delay;
+			rs485.delay_rts_before_send = _cl_rs485_before_delay;
+			if(ioctl(_fd, TIOCSRS485, &rs485) < 0) {
+				perror("Error setting RS-485 mode");
+			}
+		} else {
+			/* disable RS485 */
+			rs485.flags &= ~(SER_RS485_ENABLED | SER_RS485_RTS_ON_SEND | SER_RS485_RTS_AFTER_SEND);
+			rs485.delay_rts_after_send = 0;
+			rs485.delay_rts_before_send = 0;
+			if(ioctl(_fd, TIOCSRS485, &rs485) < 0) {
+				//perror("Error setting RS-232 mode");
+			}
+		}
+	}
+}
+
+static int diff_ms(const struct timespec *t1, const struct timespec *t2)
+{
+	struct timespec diff;
+
+	diff.tv_sec = t1->tv_sec - t2->tv_sec;
+	diff.tv_nsec = t1->tv_nsec - t2->tv_nsec;
+	if (diff.tv_nsec < 0) {
+		diff.tv_sec--;
+		diff.tv_nsec += 1000000000;
 	}
-	if (_cl_rx_timeout > 0 && _cl_tx_delay <= 0) {
-		fprintf(stderr, "ERROR: --tx-delay needed for --rx-timeout\n");
-		exit(-EINVAL);
+	return (diff.tv_sec * 1000 + diff.tv_nsec/1000000);
+}
+
+static long long int diff_us(const struct timespec *t1, const struct timespec *t2)
+{
+	return (t1->tv_sec - t2->tv_sec) * 1000000LL + (t1->tv_nsec - t2->tv_nsec) / 1000;
+}
+
+static void timespec_add_ns(struct timespec *t, long long int ns)
+{
+	ns += t->tv_nsec;
+	t->tv_sec += ns / 1000000000;
+	t->tv_nsec = ns % 1000000000;
+}
+
+// line time of one character: start bit, 8 data bits, parity and stop bits
+static long long int char_time_ns(void)
+{
+	int baud = _cl_baud ? _cl_baud : 115200;
+	int bits = 1 + 8 + _cl_parity + (_cl_2_stop_bit ? 2 : 1);
+
+	return bits * 1000000000LL / baud;
+}
+
+static int compute_error_count(void)
+{
+	long long int result;
+
+	if ((_cl_no_rx == 0 && _read_count == 0) ||
+		(_cl_no_tx == 0 && _write_count == 0)) {
+		return 127;
+	}
+
+	// a routed port receives another port's stream, run_ports() compares those
+	if (_cl_no_rx == 1 || _cl_no_tx == 1 || _rx_tag_source != _port_id)
+		result = _error_count;
+	else
+		result = llabs(_write_count - (_read_count - _crosstalk_count)) + _error_count;
+
+	result += _break_count + _line_error_count;
+	result += _frames_bad + _frames_lost;
+	result += _crosstalk_count;
+
+	return (result > 125) ? 125 : (int)result;
+}
+
+/*
+ * Result store (--results): one JSON object per line and run, flat so
+ * that it can be read back without a JSON library. --compare picks the
+ * passed runs with the same port and line configuration from a baseline
+ * file. A throughput or latency is a regression when it is more than
+ * three standard deviations worse than their mean, and at least 5%
+ * (throughput) or 10% (latency) worse to ride out a quiet baseline.
+ */
+#define EXIT_REGRESSION 126
+
+struct run_record {
+	long long int duration_ms;
+	long long int rx_bps;
+	long long int tx_bps;
+	long long int cpu_ms;
+	long long int read_gap_p99;
+	long long int rts_latency_p99;
+	long long int cts_latency_p99;
+};
+
+static const char *parity_name(void)
+{
+	if (!_cl_parity)
+		return "none";
+	if (_cl_stick_parity)
+		return _cl_odd_parity ? "mark" : "space";
+	return _cl_odd_parity ? "odd" : "even";
+}
+
+// the port as recorded, emulator ptys get a new name every run
+static const char *record_port_name(void)
+{
+	return _cl_emulate ? "emulate" : _cl_port;
+}
+
+static void collect_run_record(struct run_record *r)
+{
+	struct timespec now;
+	struct rusage ru;
+
+	memset(r, 0, sizeof(*r));
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	r->duration_ms = diff_ms(&now, &start_time) ?: 1;
+	r->rx_bps = _read_count * 8 * 1000 / r->duration_ms;
+	r->tx_bps = _write_count * 8 * 1000 / r->duration_ms;
+
+	if (getrusage(RUSAGE_SELF, &ru) == 0) {
+		r->cpu_ms = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000 +
+			(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000;
+	}
+
+	r->read_gap_p99 = _cl_rx_jitter ? hist_percentile(&_read_gap_hist, 99) : -1;
+	r->rts_latency_p99 = _cl_flow_latency > 0 ? hist_percentile(&_rts_watch.latency, 99) : -1;
+	r->cts_latency_p99 = _cl_flow_latency > 0 ? hist_percentile(&_cts_watch.latency, 99) : -1;
+}
+
+/*
+ * Options that shape the throughput by design, --compare only gates runs
+ * where all of them match. -o/-i are cleared when they expire, so run_test()
+ * keeps a copy.
+ */
+int _record_tx_time;
+int _record_rx_time;
+
+static const struct {
+	const char *key;
+	const int *value;
+} _record_settings[] = {
+	{ "tx_bytes", &_cl_tx_bytes },
+	{ "tx_adaptive", &_cl_tx_adaptive },
+	{ "frame", &_cl_frame_len },
+	{ "tx_delay_ms", &_cl_tx_delay },
+	{ "rx_delay_ms", &_cl_rx_delay },
+	{ "rx_timeout_ms", &_cl_rx_timeout },
+	{ "tx_time_s", &_record_tx_time },
+	{ "rx_time_s", &_record_rx_time },
+	{ "no_tx", &_cl_no_tx },
+	{ "no_rx", &_cl_no_rx },
+	{ "write_follow", &_cl_write_after_read },
+	{ "port_tag", &_cl_port_tag },
+	{ "mark_errors", &_cl_mark_errors },
+	{ "ascii", &_cl_ascii_range },
+};
+
+#define RECORD_SETTINGS (int)(sizeof(_record_settings) / sizeof(_record_settings[0]))
+
+static void append_results(const struct run_record *r, int result)
+{
+	char line[2048];
+	int i, len, fd;
+
+	len = snprintf(line, sizeof(line),
+		"{\"time\":%lld,\"port\":\"%s\",\"baud\":%d,\"parity\":\"%s\",\"stop_bits\":%d,"
+		"\"flow\":\"%s\",",
+		(long long int)time(NULL), record_port_name(), _cl_baud ? _cl_baud : 115200, parity_name(),
+		_cl_2_stop_bit ? 2 : 1, _cl_rts_cts ? "rts-cts" : "none");
+	for (i = 0; i < RECORD_SETTINGS; i++)
+		len += snprintf(line + len, sizeof(line) - len, "\"%s\":%d,",
+			_record_settings[i].key, *_record_settings[i].value);
+	len += snprintf(line + len, sizeof(line) - len,
+		"\"duration_ms\":%lld,\"rx\":%lld,\"tx\":%lld,\"rx_bps\":%lld,\"tx_bps\":%lld,"
+		"\"cpu_ms\":%lld,\"cpu_pct\":%.1f,"
+		"\"err_pattern\":%lld,\"err_break\":%lld,\"err_parity_framing\":%lld,"
+		"\"err_crosstalk\":%lld,\"frames_bad\":%lld,\"frames_lost\":%lld,"
+		"\"read_gap_p50_us\":%lld,\"read_gap_p99_us\":%lld,"
+		"\"rts_latency_p99_us\":%lld,\"cts_latency_p99_us\":%lld,\"result\":%d}\n",
+		r->duration_ms, _read_count, _write_count, r->rx_bps, r->tx_bps,
+		r->cpu_ms, r->cpu_ms * 100.0 / r->duration_ms,
+		_error_count, _break_count, _line_error_count,
+		_crosstalk_count, _frames_bad, _frames_lost,
+		_cl_rx_jitter ? hist_percentile(&_read_gap_hist, 50) : -1, r->read_gap_p99,
+		r->rts_latency_p99, r->cts_latency_p99, result);
+
+	// one write per record so that ports of a multi port run do not interleave
+	fd = open(_cl_results, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if (fd < 0 || write(fd, line, len) != len)
+		perror("Error writing results");
+	if (fd >= 0)
+		close(fd);
+}
+
+static int json_number(const char *line, const char *key, double *v)
+{
+	char pattern[64];
+	const char *p;
+
+	snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+	p = strstr(line, pattern);
+	if (p == NULL)
+		return 0;
+	*v = strtod(p + strlen(pattern), NULL);
+	return 1;
+}
+
+static int json_string_is(const char *line, const char *key, const char *value)
+{
+	char pattern[128];
+
+	snprintf(pattern, sizeof(pattern), "\"%s\":\"%s\"", key, value);
+	return strstr(line, pattern) != NULL;
+}
+
+static int same_configuration(const char *line)
+{
+	double v;
+	int i;
+
+	for (i = 0; i < RECORD_SETTINGS; i++) {
+		if (!json_number(line, _record_settings[i].key, &v) || v != *_record_settings[i].value)
+			return 0;
+	}
+
+	return json_number(line, "baud", &v) && v == (_cl_baud ? _cl_baud : 115200) &&
+		json_number(line, "stop_bits", &v) && v == (_cl_2_stop_bit ? 2 : 1) &&
+		json_string_is(line, "port", record_port_name()) &&
+		json_string_is(line, "parity", parity_name()) &&
+		json_string_is(line, "flow", _cl_rts_cts ? "rts-cts" : "none");
+}
+
+struct baseline {
+	const char *key;
+	int higher_is_better;
+	long long int current;
+	int n;
+	double sum;
+	double sum2;
+};
+
+static int check_baseline(struct baseline *b)
+{
+	double mean, sd, margin, delta;
+	int regressed;
+
+	if (b->n == 0 || b->current < 0)
+		return 0;
+
+	mean = b->sum / b->n;
+	sd = b->n > 1 ? sqrt((b->sum2 - b->sum * b->sum / b->n) / (b->n - 1)) : 0;
+	margin = 3 * sd;
+	if (margin < mean * (b->higher_is_better ? 0.05 : 0.10))
+		margin = mean * (b->higher_is_better ? 0.05 : 0.10);
+
+	delta = b->higher_is_better ? mean - b->current : b->current - mean;
+	regressed = delta > margin;
+
+	printf("%s%s: compare %s=%lld, baseline %.0f +/- %.0f (n=%d)%s%s\n",
+		_cl_color_output ? (regressed ? ERROR_COLOR : INFO_COLOR) : NULL_COLOR,
+		_cl_port, b->key, b->current, mean, sd, b->n,
+		regressed ? ": REGRESSION" : "",
+		_cl_color_output ? RESET_COLOR : NULL_COLOR);
+
+	return regressed;
+}
+
+// returns nonzero if the run regressed against the baseline file
+static int compare_results(const struct run_record *r)
+{
+	struct baseline checks[] = {
+		{ "rx_bps", 1, _cl_no_rx ? -1 : r->rx_bps },
+		{ "tx_bps", 1, _cl_no_tx ? -1 : r->tx_bps },
+		{ "read_gap_p99_us", 0, r->read_gap_p99 },
+		{ "rts_latency_p99_us", 0, r->rts_latency_p99 },
+		{ "cts_latency_p99_us", 0, r->cts_latency_p99 },
+	};
+	int i, regressed = 0;
+	char line[2048];
+	FILE *f;
+
+	f = fopen(_cl_compare, "r");
+	if (f == NULL) {
+		perror("Error opening baseline");
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		double result;
+
+		// failed runs are not a baseline
+		if (!same_configuration(line) || !json_number(line, "result", &result) || result != 0)
+			continue;
+		for (i = 0; i < (int)(sizeof(checks) / sizeof(checks[0])); i++) {
+			double v;
+
+			if (json_number(line, checks[i].key, &v) && v >= 0) {
+				checks[i].n++;
+				checks[i].sum += v;
+				checks[i].sum2 += v * v;
+			}
+		}
+	}
+	fclose(f);
+
+	if (checks[0].n == 0 && checks[1].n == 0)
+		printf("%s: compare: no passed runs with this configuration in %s\n", _cl_port, _cl_compare);
+
+	for (i = 0; i < (int)(sizeof(checks) / sizeof(checks[0])); i++)
+		regressed |= check_baseline(&checks[i]);
+
+	return regressed;
+}
+
+/*
+ * RS485 turnaround benchmark (--rs485-bench): for every message size and
+ * delay_rts_after_send/delay_rts_before_send pair, send requests of the
+ * counting pattern and wait for the peer to echo them. A linux-serial-test
+ * -K on the far end echoes exactly that. Each setting reports the
+ * transaction rate, replies with only the first byte wrong (turnaround
+ * too tight), other corruption and lost or short replies. The fastest
+ * setting without errors wins.
+ */
+#define RS485_BENCH_MAX_SIZES 16
+
+int _rs485_bench_delays = 3;
+int _rs485_bench_sizes[RS485_BENCH_MAX_SIZES] = { 1, 16, 64 };
+int _rs485_bench_nsizes = 3;
+int _rs485_bench_count = 20;
+int _rs485_bench_timeout = 100;
+
+enum {
+	RS485_REPLY_OK,
+	RS485_REPLY_FIRST_BYTE,
+	RS485_REPLY_CORRUPT,
+	RS485_REPLY_LOST,
+};
+
+static void parse_rs485_bench_options(char *arg)
+{
+	enum {
+		BENCH_DELAYS,
+		BENCH_SIZES,
+		BENCH_COUNT,
+		BENCH_TIMEOUT,
+	};
+	char *const tokens[] = {
+		[BENCH_DELAYS] = "delays",
+		[BENCH_SIZES] = "sizes",
+		[BENCH_COUNT] = "count",
+		[BENCH_TIMEOUT] = "timeout",
+		NULL,
+	};
+	char *value, *endptr;
+
+	while (*arg) {
+		char *opt = arg;
+		int token = getsubopt(&arg, tokens, &value);
+
+		if (token < 0) {
+			fprintf(stderr, "ERROR: unknown --rs485-bench option '%s'\n", opt);
+			exit(-EINVAL);
+		}
+		if (value == NULL) {
+			fprintf(stderr, "ERROR: --rs485-bench option '%s' needs a value\n", opt);
+			exit(-EINVAL);
+		}
+
+		switch (token) {
+		case BENCH_DELAYS:
+			_rs485_bench_delays = strtol(value, NULL, 0);
+			if (_rs485_bench_delays < 0) {
+				fprintf(stderr, "ERROR: --rs485-bench delays must be 0 or more ms\n");
+				exit(-EINVAL);
+			}
+			break;
+		case BENCH_SIZES:
+			_rs485_bench_nsizes = 0;
+			do {
+				if (_rs485_bench_nsizes == RS485_BENCH_MAX_SIZES)
+					break;
+				_rs485_bench_sizes[_rs485_bench_nsizes] = strtol(value, &endptr, 0);
+				if (_rs485_bench_sizes[_rs485_bench_nsizes] < 1 ||
+				    _rs485_bench_sizes[_rs485_bench_nsizes] > EMU_MAX_FIFO) {
+					fprintf(stderr, "ERROR: --rs485-bench sizes must be 1 to %d bytes\n", EMU_MAX_FIFO);
+					exit(-EINVAL);
+				}
+				_rs485_bench_nsizes++;
+				value = endptr + 1;
+			} while (*endptr == '/');
+			break;
+		case BENCH_COUNT:
+			_rs485_bench_count = strtol(value, NULL, 0);
+			if (_rs485_bench_count < 1) {
+				fprintf(stderr, "ERROR: --rs485-bench count must be at least 1\n");
+				exit(-EINVAL);
+			}
+			break;
+		case BENCH_TIMEOUT:
+			_rs485_bench_timeout = strtol(value, NULL, 0);
+			if (_rs485_bench_timeout < 1) {
+				fprintf(stderr, "ERROR: --rs485-bench timeout must be at least 1 ms\n");
+				exit(-EINVAL);
+			}
+			break;
+		}
+	}
+}
+
+static void rs485_bench_apply(void)
+{
+	struct serial_rs485 rs485;
+	int ret;
+
+	if (ioctl(_fd, TIOCGRS485, &rs485) == 0) {
+		// we must not hear our own request, only the reply
+		rs485.flags |= SER_RS485_ENABLED |
+			(_cl_rs485_rts_after_send ? SER_RS485_RTS_AFTER_SEND : SER_RS485_RTS_ON_SEND);
+		rs485.flags &= ~(SER_RS485_RX_DURING_TX |
+			(_cl_rs485_rts_after_send ? SER_RS485_RTS_ON_SEND : SER_RS485_RTS_AFTER_SEND));
+		rs485.delay_rts_after_send = _cl_rs485_after_delay;
+		rs485.delay_rts_before_send = _cl_rs485_before_delay;
+		if (ioctl(_fd, TIOCSRS485, &rs485) == 0)
+			return;
+	}
+
+	// the emulated peer reads the delays directly
+	if (!_cl_emulate) {
+		ret = -errno;
+		perror("Error setting RS-485 delays");
+		exit(ret);
+	}
+}
+
+// wait for the given poll event, at most until the deadline
+static int rs485_bench_wait(short events, const struct timespec *deadline)
+{
+	struct pollfd pfd = { .fd = _fd, .events = events };
+	struct timespec now;
+	int ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = diff_ms(deadline, &now);
+	if (ms < 0)
+		return 0;
+	return poll(&pfd, 1, ms) > 0;
+}
+
+static int rs485_transaction(unsigned char *req, unsigned char *reply, int size)
+{
+	struct timespec deadline;
+	int i, sent = 0, got = 0;
+
+	for (i = 0; i < size; i++) {
+		req[i] = _write_count_value;
+		_write_count_value = next_count_value(_write_count_value);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	timespec_add_ns(&deadline, _rs485_bench_timeout * 1000000LL);
+
+	while (sent < size && rs485_bench_wait(POLLOUT, &deadline)) {
+		ssize_t c = write(_fd, req + sent, size - sent);
+		if (c > 0)
+			sent += c;
+	}
+	tcdrain(_fd);
+	_write_count += sent;
+
+	timespec_add_ns(&deadline, (long long int)size * char_time_ns());
+	while (got < size && rs485_bench_wait(POLLIN, &deadline)) {
+		ssize_t c = read(_fd, reply + got, size - got);
+		if (c > 0)
+			got += c;
+	}
+	_read_count += got;
+
+	if (got < size)
+		return RS485_REPLY_LOST;
+	if (memcmp(req + 1, reply + 1, size - 1))
+		return RS485_REPLY_CORRUPT;
+	if (req[0] != reply[0])
+		return RS485_REPLY_FIRST_BYTE;
+	return RS485_REPLY_OK;
+}
+
+/*
+ * The fastest safe setting is the one with the smallest after + before
+ * whose mean transaction time is within the noise of the best error-free
+ * one: two standard errors of the difference of the means. A longer delay
+ * cannot really be faster, it only measured so.
+ */
+struct rs485_bench_result {
+	int after;
+	int before;
+	int safe;
+	double mean_us;
+	double sem_us;
+};
+
+static int run_rs485_bench(void)
+{
+	unsigned char req[EMU_MAX_FIFO], reply[EMU_MAX_FIFO];
+	int settings = (_rs485_bench_delays + 1) * (_rs485_bench_delays + 1);
+	struct rs485_bench_result *res = calloc(settings, sizeof(*res));
+	int s, after, before, k, unsafe = 0;
+
+	if (res == NULL) {
+		fprintf(stderr, "ERROR: Memory allocation failed\n");
+		exit(-ENOMEM);
+	}
+
+	for (s = 0; s < _rs485_bench_nsizes; s++) {
+		int size = _rs485_bench_sizes[s];
+		struct rs485_bench_result *best = NULL, *pick = NULL;
+		int n = 0;
+
+		for (before = 0; before <= _rs485_bench_delays; before++) {
+			for (after = 0; after <= _rs485_bench_delays; after++) {
+				int results[RS485_REPLY_LOST + 1] = { 0 };
+				struct rs485_bench_result *r = &res[n++];
+				double sum = 0, sum2 = 0;
+
+				_cl_rs485_after_delay = after;
+				_cl_rs485_before_delay = before;
+				rs485_bench_apply();
+
+				for (k = 0; k < _rs485_bench_count; k++) {
+					struct timespec t0, t1;
+					int ret;
+					double us;
+
+					clock_gettime(CLOCK_MONOTONIC, &t0);
+					ret = rs485_transaction(req, reply, size);
+					clock_gettime(CLOCK_MONOTONIC, &t1);
+					us = diff_us(&t1, &t0);
+					sum += us;
+					sum2 += us * us;
+
+					results[ret]++;
+					if (ret != RS485_REPLY_OK) {
+						// let a late reply arrive and drop it
+						usleep(_rs485_bench_timeout * 1000);
+						tcflush(_fd, TCIFLUSH);
+					}
+				}
+
+				r->after = after;
+				r->before = before;
+				r->safe = results[RS485_REPLY_OK] == _rs485_bench_count;
+				r->mean_us = sum / _rs485_bench_count;
+				r->sem_us = _rs485_bench_count > 1 ?
+					sqrt((sum2 - sum * sum / _rs485_bench_count) /
+					     (_rs485_bench_count - 1) / _rs485_bench_count) : 0;
+
+				printf("%s: rs485 size=%d after=%d before=%d: %.1f transactions/s, first byte errors=%d, corrupt=%d, lost=%d\n",
+					_cl_port, size, after, before, 1000000.0 / (r->mean_us ?: 1),
+					results[RS485_REPLY_FIRST_BYTE], results[RS485_REPLY_CORRUPT],
+					results[RS485_REPLY_LOST]);
+
+				_error_count += results[RS485_REPLY_FIRST_BYTE] + results[RS485_REPLY_CORRUPT];
+				if (r->safe && (best == NULL || r->mean_us < best->mean_us))
+					best = r;
+			}
+		}
+
+		for (k = 0; best && k < n; k++) {
+			struct rs485_bench_result *r = &res[k];
+			double noise = 2 * sqrt(r->sem_us * r->sem_us + best->sem_us * best->sem_us);
+
+			if (!r->safe || r->mean_us > best->mean_us + noise)
+				continue;
+			if (pick == NULL || r->after + r->before < pick->after + pick->before ||
+			    (r->after + r->before == pick->after + pick->before && r->mean_us < pick->mean_us))
+				pick = r;
+		}
+
+		if (pick == NULL) {
+			printf("%s%s: rs485 size=%d: no setting without errors%s\n",
+				_cl_color_output ? ERROR_COLOR : NULL_COLOR,
+				_cl_port, size,
+				_cl_color_output ? RESET_COLOR : NULL_COLOR);
+			unsafe++;
+		} else {
+			printf("%s%s: rs485 size=%d: fastest safe setting -q %d.%d (%.1f transactions/s)%s\n",
+				_cl_color_output ? INFO_COLOR : NULL_COLOR,
+				_cl_port, size, pick->after, pick->before, 1000000.0 / (pick->mean_us ?: 1),
+				_cl_color_output ? RESET_COLOR : NULL_COLOR);
+		}
 	}
 
+	free(res);
+	return unsafe;
+}
+
+static void send_port_report(void)
+{
+	struct port_report report;
+
+	memset(&report, 0, sizeof(report));
+	report.source = _rx_tag_source;
+	report.rx = _read_count - _crosstalk_count;
+	report.tx = _write_count;
+	memcpy(report.crosstalk, _crosstalk, sizeof(report.crosstalk));
+
+	if (write(_report_fd, &report, sizeof(report)) != sizeof(report))
+		perror("Error sending port report");
+	close(_report_fd);
+	_report_fd = -1;
+}
+
+static int run_test(void)
+{
+	int runtime_no_tx = _cl_no_tx;
+	int runtime_no_rx = _cl_no_rx;
 	int baud = B115200;
 
+	_record_tx_time = _cl_tx_time;
+	_record_rx_time = _cl_rx_time;
+
+	if (_cl_emulate)
+		setup_emulator();
+
 	if (_cl_baud && !_cl_divisor)
 		baud = get_baud(_cl_baud);
 
-	if (baud <= 0 || _cl_divisor) {
+	if (_cl_emulate) {
+		// the emulator paces bytes at --baud itself, the pty ignores termios speed
+		setup_serial_port(baud > 0 ? baud : B38400);
+	} else if (baud <= 0 || _cl_divisor) {
 		printf("NOTE: non standard baud rate, trying custom divisor\n");
 		baud = B38400;
 		setup_serial_port(B38400);
@@ -756,7 +3153,8 @@ int main(int argc, char * argv[])
 		clear_custom_speed_flag();
 	}
 
-	set_modem_lines(_fd, _cl_loopback ? TIOCM_LOOP : 0, TIOCM_LOOP);
+	if (!_cl_emulate)
+		set_modem_lines(_fd, _cl_loopback ? TIOCM_LOOP : 0, TIOCM_LOOP);
 
 	if (_cl_single_byte >= 0) {
 		unsigned char data[2];
@@ -779,7 +3177,22 @@ int main(int argc, char * argv[])
 		return 0;
 	}
 
-	_write_size = (_cl_tx_bytes == 0) ? 1024 : _cl_tx_bytes;
+	_tx_queue_size = sysconf(_SC_PAGESIZE);
+
+	if (_cl_tx_bytes)
+		_write_size = _cl_tx_bytes;
+	else if (_cl_tx_adaptive >= 0)
+		_write_size = _cl_tx_adaptive > _tx_queue_size ? _cl_tx_adaptive : _tx_queue_size;
+	else
+		_write_size = 1024;
+
+	/*
+	 * --rx-jitter reports how much each read returns, so do not cut a
+	 * flip buffer push (up to the 4 KB N_TTY buffer and more) in pieces.
+	 */
+	_read_size = _write_size * 2;
+	if (_cl_rx_jitter && _read_size < RX_JITTER_READ_SIZE)
+		_read_size = RX_JITTER_READ_SIZE;
 
 	_write_data = malloc(_write_size);
 	if (_write_data == NULL) {
@@ -791,6 +3204,29 @@ int main(int argc, char * argv[])
 		_read_count_value = _write_count_value = 32;
 	}
 
+	_rx_tag_source = _tag_route[_port_id];
+
+	if (_cl_frame_len) {
+		crc32_init();
+		_tx_frame = malloc(_cl_frame_len);
+		_rx_frame = malloc(_cl_frame_len);
+		if (_tx_frame == NULL || _rx_frame == NULL) {
+			fprintf(stderr, "ERROR: Memory allocation failed\n");
+			exit(-ENOMEM);
+		}
+	}
+
+	if (_cl_rs485_bench) {
+		int unsafe;
+
+		clock_gettime(CLOCK_MONOTONIC, &start_time);
+		start_helpers();
+		unsafe = run_rs485_bench();
+		stop_helpers();
+		dump_final_stats();
+		return unsafe > 125 ? 125 : unsafe;
+	}
+
 	struct pollfd serial_poll;
 	serial_poll.fd = _fd;
 	if (!runtime_no_rx) {
@@ -807,7 +3243,10 @@ int main(int argc, char * argv[])
 
 	struct timespec last_stat, last_timeout, last_read, last_write;
 
+	_tx_queue.size = _tx_queue_size;
+
 	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	start_helpers();
 	last_stat = start_time;
 	last_timeout = start_time;
 	last_read = start_time;
@@ -815,7 +3254,25 @@ int main(int argc, char * argv[])
 
 	while (!(runtime_no_rx && runtime_no_tx)) {
 		struct timespec current;
-		int retval = poll(&serial_poll, 1, 1000);
+		int timeout = 1000;
+
+		if (_tx_hold) {
+			// adaptive TX: leave POLLOUT off until the queue drained
+			clock_gettime(CLOCK_MONOTONIC, &current);
+			long long int us = diff_us(&_tx_resume_time, &current);
+			if (us <= 0 || runtime_no_tx) {
+				_tx_hold = 0;
+				if (!runtime_no_tx)
+					serial_poll.events |= POLLOUT;
+			} else {
+				serial_poll.events &= ~POLLOUT;
+				timeout = us < 1000000 ? (us + 999) / 1000 : 1000;
+			}
+		}
+
+		int retval = poll(&serial_poll, 1, timeout);
+
+		PROBE2(poll, retval, serial_poll.revents);
 
 		clock_gettime(CLOCK_MONOTONIC, &current);
 
@@ -824,7 +3281,7 @@ int main(int argc, char * argv[])
 		} else if (retval) {
 			if (serial_poll.revents & POLLIN) {
 				if (_cl_rx_timeout) {
-					if (process_read_data() > 0) {
+					if (_process_read_data() > 0) {
 						clock_gettime(CLOCK_MONOTONIC, &last_read);
 					}
 					// must keep reading until timeout
@@ -834,11 +3291,11 @@ int main(int argc, char * argv[])
 					// only read if it has been rx-delay ms
 					// since the last read
 					if (diff_ms(&current, &last_read) > _cl_rx_delay) {
-						process_read_data();
+						_process_read_data();
 						clock_gettime(CLOCK_MONOTONIC, &last_read);
 					}
 				} else {
-					process_read_data();
+					_process_read_data();
 					clock_gettime(CLOCK_MONOTONIC, &last_read);
 				}
 			} else {
@@ -854,11 +3311,11 @@ int main(int argc, char * argv[])
 					// only write if it has been tx-delay ms
 					// since the last write
 					if (diff_ms(&current, &last_write) > _cl_tx_delay) {
-						process_write_data();
+						_process_write_data();
 						clock_gettime(CLOCK_MONOTONIC, &last_write);
 					}
 				} else {
-					process_write_data();
+					_process_write_data();
 					clock_gettime(CLOCK_MONOTONIC, &last_write);
 				}
 			}
@@ -924,9 +3381,202 @@ int main(int argc, char * argv[])
 	}
 
 	tcdrain(_fd);
+	stop_helpers();
 	dump_serial_port_stats();
-	set_modem_lines(_fd, 0, TIOCM_LOOP);
+	dump_final_stats();
+	if (!_cl_emulate)
+		set_modem_lines(_fd, 0, TIOCM_LOOP);
 	tcflush(_fd, TCIOFLUSH);
 
-	return compute_error_count();
+	if (_report_fd >= 0)
+		send_port_report();
+
+	int result = compute_error_count();
+
+	if (_cl_results || _cl_compare) {
+		struct run_record record;
+
+		collect_run_record(&record);
+		if (_cl_compare && compare_results(&record) && result == 0)
+			result = EXIT_REGRESSION;
+		if (_cl_results)
+			append_results(&record, result);
+	}
+
+	return result;
+}
+
+/*
+ * Several ports given as -p a,b,c: fork one copy of the test per port so
+ * that all of them run at full rate at the same time, each with its own
+ * globals. With --port-tag every child reports the crosstalk it saw and
+ * the parent prints the routing matrix.
+ */
+static int run_ports(void)
+{
+	struct port_report reports[MAX_TAGGED_PORTS];
+	char *names[MAX_TAGGED_PORTS];
+	int pipes[MAX_TAGGED_PORTS];
+	pid_t pids[MAX_TAGGED_PORTS];
+	char *list = strdup(_cl_port);
+	char *save, *name;
+	int i, j, n = 0, result = 0;
+
+	for (name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+		if (n == MAX_TAGGED_PORTS) {
+			fprintf(stderr, "ERROR: at most %d ports can be tested together\n", MAX_TAGGED_PORTS);
+			exit(-EINVAL);
+		}
+		names[n++] = name;
+	}
+
+	fflush(stdout);
+	for (i = 0; i < n; i++) {
+		int fds[2];
+
+		if (pipe(fds) < 0) {
+			int ret = -errno;
+			perror("pipe()");
+			exit(ret);
+		}
+
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			int ret = -errno;
+			perror("fork()");
+			exit(ret);
+		}
+		if (pids[i] == 0) {
+			close(fds[0]);
+			free(_cl_port);
+			_cl_port = strdup(names[i]);
+			free(list);
+			_port_id = i;
+			_port_count = n;
+			_report_fd = fds[1];
+			exit(run_test());
+		}
+		close(fds[1]);
+		pipes[i] = fds[0];
+	}
+
+	for (i = 0; i < n; i++) {
+		int status;
+
+		memset(&reports[i], 0, sizeof(reports[i]));
+		reports[i].source = -1;
+		if (read(pipes[i], &reports[i], sizeof(reports[i])) != sizeof(reports[i]))
+			reports[i].source = -1;
+		close(pipes[i]);
+
+		waitpid(pids[i], &status, 0);
+		if (WIFEXITED(status) && WEXITSTATUS(status) > result)
+			result = WEXITSTATUS(status);
+		else if (!WIFEXITED(status))
+			result = 127;
+	}
+
+	if (_cl_port_tag) {
+		long long int crosstalk = 0;
+
+		printf("Routing matrix (bytes received, rows: rx port, columns: tx port):\n");
+		printf("%-16s", "");
+		for (j = 0; j < n; j++)
+			printf(" %12d", j);
+		printf("\n");
+		for (i = 0; i < n; i++) {
+			printf("%2d %-13s", i, names[i]);
+			for (j = 0; j < n; j++) {
+				long long int v = reports[i].crosstalk[j];
+
+				// a receiver never counts its own source as crosstalk
+				if (j == reports[i].source)
+					v = reports[i].rx;
+				else
+					crosstalk += v;
+				printf(" %12lld", v);
+			}
+			printf("\n");
+		}
+		printf("%scrosstalk=%lld%s\n",
+			_cl_color_output && crosstalk > 0 ? ERROR_COLOR : NULL_COLOR,
+			crosstalk,
+			_cl_color_output ? RESET_COLOR : NULL_COLOR);
+
+		for (i = 0; i < n; i++) {
+			int source = reports[i].source;
+			long long int missing;
+
+			if (source < 0 || source == i || _cl_no_rx || _cl_no_tx)
+				continue;
+			missing = llabs(reports[source].tx - reports[i].rx);
+			if (missing) {
+				printf("%s%s: received %lld of the %lld bytes port %d sent%s\n",
+					_cl_color_output ? ERROR_COLOR : NULL_COLOR,
+					names[i], reports[i].rx, reports[source].tx, source,
+					_cl_color_output ? RESET_COLOR : NULL_COLOR);
+				if (missing > 125)
+					missing = 125;
+				if (missing > result)
+					result = missing;
+			}
+		}
+	}
+
+	free(list);
+	return result;
+}
+
+int main(int argc, char * argv[])
+{
+	atexit(&exit_handler);
+
+	process_options(argc, argv);
+
+	if (_cl_kernel_bench)
+		return run_kernel_bench();
+
+	if (!_cl_port && !_cl_emulate) {
+		fprintf(stderr, "ERROR: Port argument required\n");
+		display_help();
+		exit(-EINVAL);
+	}
+	if (_cl_port && _cl_emulate) {
+		fprintf(stderr, "ERROR: --emulate replaces --port\n");
+		exit(-EINVAL);
+	}
+	if (_cl_rx_timeout > 0 && _cl_tx_delay <= 0) {
+		fprintf(stderr, "ERROR: --tx-delay needed for --rx-timeout\n");
+		exit(-EINVAL);
+	}
+	if (_cl_frame_len && _cl_frame_len <= FRAME_OVERHEAD) {
+		fprintf(stderr, "ERROR: --frame length must be more than %d bytes\n", FRAME_OVERHEAD);
+		exit(-EINVAL);
+	}
+	if (_cl_port_tag && (_cl_frame_len || _cl_ascii_range)) {
+		fprintf(stderr, "ERROR: --port-tag cannot be combined with --frame or --ascii\n");
+		exit(-EINVAL);
+	}
+	if (_tag_route_len) {
+		int i, ports = 1;
+
+		for (i = 0; _cl_port && _cl_port[i]; i++)
+			ports += _cl_port[i] == ',';
+		for (i = 0; i < _tag_route_len; i++) {
+			if (_tag_route[i] >= ports)
+				break;
+		}
+		if (_tag_route_len != ports || i < _tag_route_len) {
+			fprintf(stderr, "ERROR: --port-tag needs a source port of the run for each of the %d port(s)\n", ports);
+			exit(-EINVAL);
+		}
+	}
+
+	select_kernels();
+
+	if (_cl_port && strchr(_cl_port, ','))
+		return run_ports();
+
+	return run_test();
 }
+